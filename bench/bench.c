@@ -0,0 +1,305 @@
+/*
+ * Load each of the benchmark scenarios from the stand-in server (see
+ * server.c) a few times, and print how long each stage took, as one line
+ * of JSON per scenario:
+ *
+ *     first_paint_ms  until there's a screenful of the (last) page
+ *     load_ms         until the whole of it is in
+ *     parse_ms        to parse it again, without the network
+ *     redraw_ms       to redraw a screen of it, on average
+ *
+ * Each is the median of the runs. redraw_ms is null if there's no
+ * terminal to draw on.
+ */
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "config.h"
+#include "conn.h"
+#include "curl/url.h"
+#include "dns.h"
+#include "fetch.h"
+#include "gemini.h"
+#include "history.h"
+#include "strlcpy.h"
+#include "tabs.h"
+#include "termbox.h"
+#include "ui.h"
+#include "util.h"
+
+#define MAXRUNS 64
+
+static const struct Scenario {
+	char *name, *path;
+	size_t follow; /* how many times to follow the first link */
+} scenarios[] = {
+	{ "small",     "/huge/40",     0 },
+	{ "huge",      "/huge/100000", 0 },
+	{ "tree",      "/tree/8/0",    8 },
+	{ "slow",      "/slow/2000",   0 },
+	{ "redirects", "/redirect/5",  0 },
+};
+
+struct Run {
+	double first_paint, load, parse, redraw;
+	size_t bytes, lines, requests;
+};
+
+struct Load {
+	struct Fetch *f;
+	struct Gemdoc *doc;
+	ssize_t status;
+	char error[256];
+	size_t bytes;
+};
+
+static size_t screen = 50;
+static _Bool drawing = false;
+
+static double
+ms_since(struct timeval *start)
+{
+	struct timeval now, elapsed;
+	ENSURE(gettimeofday(&now, NULL) == 0);
+	timersub(&now, start, &elapsed);
+	return elapsed.tv_sec * 1e3 + elapsed.tv_usec / 1e3;
+}
+
+static void
+loaded(struct Fetch *f)
+{
+	struct Load *l = (struct Load *)f->data;
+	l->f = NULL;
+	l->status = f->status;
+	l->bytes += f->received;
+	strlcpy(l->error, f->error, sizeof(l->error));
+	l->doc = f->doc, f->doc = NULL;
+}
+
+/* the next URL to load after doc, if any. */
+static CURLU *
+next_url(struct Gemdoc *doc, size_t *follow, size_t *redirects)
+{
+	CURLU *url = NULL;
+
+	if (doc->type == GEM_TYPE_REDIRECT && ++*redirects <= c_maximum_redirects) {
+		url = curl_url_dup(doc->url);
+		if (curl_url_set(url, CURLUPART_URL, doc->meta, 0))
+			curl_url_cleanup(url), url = NULL;
+	} else if (doc->type == GEM_TYPE_SUCCESS && *follow > 0) {
+		--*follow, *redirects = 0;
+		gemdoc_find_link(doc, 1, NULL, &url);
+	}
+
+	return url;
+}
+
+/* average time to draw a screenful, over every screen of the document. */
+static double
+redraw(struct Gemdoc *doc)
+{
+	tabs_add(tabs);
+	curtab = tabs->next;
+	hist_add(&CURTAB()->visited, doc);
+
+	struct timeval start;
+	ENSURE(gettimeofday(&start, NULL) == 0);
+
+	size_t frames = 0, height = ui_redraw();
+	for (CURTAB()->ui_vscroll = 0; frames < 200; ++frames) {
+		ui_redraw();
+		tb_present();
+		if ((CURTAB()->ui_vscroll += tb_height()) >= height)
+			break;
+	}
+
+	double took = ms_since(&start) / (frames + 1);
+	tabs_rm(curtab);
+	curtab = tabs;
+	return took;
+}
+
+static _Bool
+run(char *base, const struct Scenario *s, struct Run *r)
+{
+	size_t follow = s->follow, redirects = 0;
+	struct Load l;
+	memset(&l, 0x0, sizeof(l));
+	memset(r, 0x0, sizeof(*r));
+
+	CURLU *url = curl_url();
+	if (curl_url_set(url, CURLUPART_URL, format("%s%s", base, s->path), 0)) {
+		fprintf(stderr, "bench: invalid URL '%s%s'\n", base, s->path);
+		curl_url_cleanup(url);
+		return false;
+	}
+
+	struct timeval start, page;
+	_Bool painted = false;
+	ENSURE(gettimeofday(&start, NULL) == 0);
+
+	while (url) {
+		ENSURE(gettimeofday(&page, NULL) == 0);
+		l.f = fetch_new(url, FETCH_PRIO_FOREGROUND, FETCH_NOCACHE,
+			&loaded, (void *)&l);
+		++r->requests;
+
+		/* the time to first paint is only that of the last page;
+		 * keep resetting it until we get there */
+		painted = false;
+		while (l.f) {
+			fetch_poll(16);
+			if (l.f && !painted && l.f->header
+					&& l.f->lines >= screen) {
+				r->first_paint = ms_since(&start);
+				painted = true;
+			}
+		}
+
+		if (l.status != 0) {
+			fprintf(stderr, "bench: %s: %s\n", s->name, l.error);
+			gemdoc_free(l.doc);
+			return false;
+		}
+
+		if ((url = next_url(l.doc, &follow, &redirects)))
+			gemdoc_free(l.doc);
+	}
+
+	r->load = ms_since(&start);
+	if (!painted)
+		r->first_paint = r->load;
+	r->bytes = l.bytes;
+	r->lines = lnklist_len(l.doc->rawdoc);
+
+	size_t len;
+	char *response = gemdoc_serialize(l.doc, &len);
+	struct Gemdoc *again = gemdoc_new(curl_url_dup(l.doc->url));
+
+	ENSURE(gettimeofday(&start, NULL) == 0);
+	gemdoc_parse_buf(again, response, len);
+	r->parse = ms_since(&start);
+
+	gemdoc_free(again);
+	free(response);
+
+	r->redraw = drawing ? redraw(l.doc) : -1;
+	if (!drawing)
+		gemdoc_free(l.doc);
+	return true;
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static double
+median(struct Run *runs, size_t n, size_t offset)
+{
+	double v[MAXRUNS];
+	for (size_t i = 0; i < n; ++i)
+		v[i] = *(double *)((char *)&runs[i] + offset);
+	qsort(v, n, sizeof(double), &cmp);
+	return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: bench [-n] [-r runs] [-s scenario] gemini://host:port\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t runs = 5;
+	char *only = NULL;
+	_Bool nodraw = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "nr:s:")) != -1) {
+		switch (opt) {
+		break; case 'n':
+			nodraw = true;
+		break; case 'r':
+			runs = strtoul(optarg, NULL, 10);
+			if (runs == 0 || runs > MAXRUNS)
+				usage();
+		break; case 's':
+			only = optarg;
+		break; default:
+			usage();
+		}
+	}
+
+	if (argc - optind != 1)
+		usage();
+
+	ENSURE(conn_init());
+	tabs_init();
+
+	/* only draw if there's something to draw on */
+	int tty = nodraw ? -1 : open("/dev/tty", O_RDWR);
+	if (tty != -1) {
+		close(tty);
+		ui_init();
+		screen = tb_height();
+		drawing = true;
+	}
+
+	struct Run results[SIZEOF(scenarios)][MAXRUNS];
+	_Bool ok[SIZEOF(scenarios)] = { false };
+
+	for (size_t i = 0; i < SIZEOF(scenarios); ++i) {
+		if (only && strcmp(only, scenarios[i].name))
+			continue;
+
+		ok[i] = true;
+		for (size_t j = 0; ok[i] && j < runs; ++j)
+			ok[i] = run(argv[optind], &scenarios[i], &results[i][j]);
+
+		/* don't let the cache make later runs look better */
+		cache_free();
+	}
+
+	ui_shutdown();
+
+	for (size_t i = 0; i < SIZEOF(scenarios); ++i) {
+		if (!ok[i]) continue;
+
+		struct Run *r = results[i];
+		printf("{\"scenario\":\"%s\",\"runs\":%zu,\"requests\":%zu,"
+			"\"bytes\":%zu,\"lines\":%zu,\"first_paint_ms\":%.3f,"
+			"\"load_ms\":%.3f,\"parse_ms\":%.3f,",
+			scenarios[i].name, runs, r->requests, r->bytes, r->lines,
+			median(r, runs, offsetof(struct Run, first_paint)),
+			median(r, runs, offsetof(struct Run, load)),
+			median(r, runs, offsetof(struct Run, parse)));
+		if (drawing)
+			printf("\"redraw_ms\":%.3f}\n",
+				median(r, runs, offsetof(struct Run, redraw)));
+		else
+			printf("\"redraw_ms\":null}\n");
+	}
+
+	tabs_free();
+	conn_shutdown();
+	dns_flush();
+
+	for (size_t i = 0; i < SIZEOF(scenarios); ++i)
+		if (!ok[i] && (!only || !strcmp(only, scenarios[i].name)))
+			return 1;
+	return 0;
+}
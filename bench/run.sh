@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# Start the stand-in server, run the benchmarks against it, and stop it
+# again. Results go to stdout, one line of JSON per scenario.
+#
+# BENCH_PORT, BENCH_LATENCY (ms), BENCH_BANDWIDTH (bytes/s; 0 for no
+# limit) and BENCH_FLAGS (passed to bench/bench) can be set to taste.
+
+set -e
+cd "$(dirname "$0")"
+
+port=${BENCH_PORT:-19650}
+latency=${BENCH_LATENCY:-20}
+bandwidth=${BENCH_BANDWIDTH:-0}
+
+if [ ! -f cert.pem ] || [ ! -f key.pem ]; then
+	openssl req -x509 -newkey rsa:2048 -nodes -days 3650 \
+		-subj /CN=localhost -keyout key.pem -out cert.pem 2>/dev/null
+fi
+
+./server -p "$port" -l "$latency" -b "$bandwidth" cert.pem key.pem &
+server=$!
+trap 'kill $server 2>/dev/null' EXIT INT TERM
+
+# give it a moment to start listening
+sleep 1
+
+./bench $BENCH_FLAGS "gemini://localhost:$port"
@@ -0,0 +1,291 @@
+/*
+ * A stand-in Gemini server for benchmarking, serving synthetic capsules:
+ *
+ *     /huge/<lines>            a gemtext document that long
+ *     /tree/<depth>/<node>     a tree of pages, TREE_FANOUT links each
+ *     /slow/<ms>               a document trickled out over that long
+ *     /redirect/<n>            n redirects, then a page
+ *
+ * Every response is held back by the latency given with -l, and sent no
+ * faster than the bandwidth given with -b.
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#define TREE_FANOUT 16
+#define SLOW_LINES  200
+
+static size_t latency = 0;   /* ms */
+static size_t bandwidth = 0; /* bytes a second; 0 for no limit */
+
+/* when the response started, and how much of it's been sent since
+ * (there's one connection per process) */
+static struct timespec started;
+static size_t sent = 0;
+
+static void
+die(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "server: ");
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+
+	if (fmt[0] && fmt[strlen(fmt) - 1] == ':')
+		perror(" ");
+	else
+		fputc('\n', stderr);
+	exit(1);
+}
+
+static void
+sleep_ms(size_t ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+static size_t
+elapsed_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - started.tv_sec) * 1000
+		+ (now.tv_nsec - started.tv_nsec) / 1000000;
+}
+
+/*
+ * With a bandwidth limit, everything sent on the connection so far is
+ * held to it, however it's split up between calls; a hundredth of a
+ * second's worth is sent at a time, and we sleep whenever we're ahead.
+ */
+static _Bool
+send_all(struct tls *c, const char *data, size_t len)
+{
+	size_t chunk = bandwidth ? bandwidth / 100 + 1 : len;
+
+	while (len > 0) {
+		size_t n = len < chunk ? len : chunk;
+		ssize_t w = tls_write(c, data, n);
+		if (w == TLS_WANT_POLLIN || w == TLS_WANT_POLLOUT)
+			continue;
+		if (w < 0)
+			return false;
+
+		data += w, len -= w, sent += w;
+		if (bandwidth) {
+			size_t due = sent * 1000 / bandwidth, now = elapsed_ms();
+			if (due > now)
+				sleep_ms(due - now);
+		}
+	}
+
+	return true;
+}
+
+static _Bool
+sendf(struct tls *c, const char *fmt, ...)
+{
+	char buf[4096];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	return len >= 0 && send_all(c, buf, (size_t)len < sizeof(buf)
+		? (size_t)len : sizeof(buf) - 1);
+}
+
+/* a line of filler gemtext; every kind of line turns up eventually. */
+static _Bool
+send_line(struct tls *c, size_t i)
+{
+	switch (i % 10) {
+	break; case 0:
+		return sendf(c, "## Section %zu\n", i / 10);
+	break; case 3:
+		return sendf(c, "=> /huge/%zu Link number %zu\n", i % 1000, i);
+	break; case 5:
+		return sendf(c, "* List item %zu\n", i);
+	break; case 7:
+		return sendf(c, "> Quoted line %zu\n", i);
+	break; case 8:
+		return sendf(c, i % 20 == 8 ? "```\n" : "   preformatted(%zu)\n", i);
+	break; default:
+		return sendf(c, "Line %zu of filler text, which goes on for a "
+			"while so that it has to be folded on narrower screens "
+			"like most paragraphs do.\n", i);
+	}
+}
+
+static void
+serve(struct tls *c, char *url)
+{
+	char *path = strstr(url, "://");
+	path = path ? strchr(path + 3, '/') : NULL;
+	size_t a = 0, b = 0;
+
+	sleep_ms(latency);
+	clock_gettime(CLOCK_MONOTONIC, &started);
+
+	if (path && sscanf(path, "/huge/%zu", &a) == 1) {
+		sendf(c, "20 text/gemini\r\n# %zu lines\n", a);
+		for (size_t i = 1; i < a; ++i)
+			if (!send_line(c, i))
+				return;
+	} else if (path && sscanf(path, "/tree/%zu/%zu", &a, &b) == 2) {
+		sendf(c, "20 text/gemini\r\n# Node %zu, depth %zu\n", b, a);
+		for (size_t i = 0; a > 0 && i < TREE_FANOUT; ++i)
+			sendf(c, "=> /tree/%zu/%zu Child %zu\n", a - 1,
+				b * TREE_FANOUT + i, i);
+		if (a == 0)
+			sendf(c, "A leaf.\n");
+	} else if (path && sscanf(path, "/slow/%zu", &a) == 1) {
+		sendf(c, "20 text/gemini\r\n# Slow\n");
+		for (size_t i = 1; i < SLOW_LINES; ++i) {
+			sleep_ms(a / SLOW_LINES);
+			if (!send_line(c, i))
+				return;
+		}
+	} else if (path && sscanf(path, "/redirect/%zu", &a) == 1) {
+		if (a > 0)
+			sendf(c, "31 /redirect/%zu\r\n", a - 1);
+		else
+			sendf(c, "20 text/gemini\r\n# Redirected\n");
+	} else if (path && (!strcmp(path, "/") || !path[1])) {
+		sendf(c, "20 text/gemini\r\n# Benchmark capsules\n"
+			"=> /huge/100000 A huge document\n"
+			"=> /tree/8/0 A deep tree\n"
+			"=> /slow/2000 A slow document\n"
+			"=> /redirect/5 A chain of redirects\n");
+	} else {
+		sendf(c, "51 Not found\r\n");
+	}
+}
+
+static void
+handle(struct tls *server, int fd)
+{
+	struct tls *c;
+	if (tls_accept_socket(server, &c, fd) != 0)
+		return;
+
+	char url[1027];
+	size_t len = 0;
+
+	while (len < sizeof(url) - 1) {
+		ssize_t r = tls_read(c, &url[len], sizeof(url) - 1 - len);
+		if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT)
+			continue;
+		if (r <= 0)
+			break;
+		len += r;
+		url[len] = '\0';
+		if (strstr(url, "\r\n"))
+			break;
+	}
+
+	url[len] = '\0';
+	char *end = strstr(url, "\r\n");
+	if (end) {
+		*end = '\0';
+		serve(c, url);
+	} else {
+		sendf(c, "59 Bad request\r\n");
+	}
+
+	tls_close(c);
+	tls_free(c);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: server [-p port] [-l latency-ms] "
+		"[-b bytes-per-second] cert key\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int port = 1965, opt;
+
+	while ((opt = getopt(argc, argv, "p:l:b:")) != -1) {
+		switch (opt) {
+		break; case 'p':
+			port = atoi(optarg);
+		break; case 'l':
+			latency = strtoul(optarg, NULL, 10);
+		break; case 'b':
+			bandwidth = strtoul(optarg, NULL, 10);
+		break; default:
+			usage();
+		}
+	}
+
+	if (argc - optind != 2)
+		usage();
+
+	struct tls_config *cfg = tls_config_new();
+	if (!cfg)
+		die("unable to allocate TLS config");
+	if (tls_config_set_cert_file(cfg, argv[optind]) != 0
+			|| tls_config_set_key_file(cfg, argv[optind + 1]) != 0)
+		die("%s", tls_config_error(cfg));
+
+	struct tls *server = tls_server();
+	if (!server || tls_configure(server, cfg) != 0)
+		die("unable to set up TLS: %s", server ? tls_error(server) : "");
+
+	int s = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+	if (s == -1)
+		die("socket:");
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in addr = { 0 };
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		die("bind:");
+	if (listen(s, 64) == -1)
+		die("listen:");
+
+	/* one process per connection, so that slow responses don't hold
+	 * up anything else */
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	while ("serving") {
+		int fd = accept(s, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR) continue;
+			die("accept:");
+		}
+
+		switch (fork()) {
+		break; case -1:
+			close(fd);
+		break; case 0:
+			close(s);
+			handle(server, fd);
+			close(fd);
+			_exit(0);
+		break; default:
+			close(fd);
+		}
+	}
+}
@@ -0,0 +1,230 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "cache.h"
+#include "config.h"
+#include "curl/url.h"
+#include "list.h"
+#include "util.h"
+
+/*
+ * Response cache, most recently used first. The least recently used
+ * entries are evicted to keep the total size of the cached responses
+ * under c_cache_bytes.
+ */
+static struct lnklist *entries = NULL;
+static struct CacheStats stats = { 0 };
+
+/* permanent redirects, by the key of the URL that was redirected. */
+static struct lnklist *redirects = NULL;
+
+static void
+_entry_free(struct CacheEntry *e)
+{
+	free(e->key);
+	free(e->data);
+	free(e);
+}
+
+static struct lnklist *
+_find(char *key)
+{
+	if (!entries)
+		entries = lnklist_new();
+
+	for (struct lnklist *l = entries->next; l; l = l->next)
+		if (!strcmp(((struct CacheEntry *)l->data)->key, key))
+			return l;
+	return NULL;
+}
+
+static void
+_evict(struct lnklist *l)
+{
+	struct CacheEntry *e = (struct CacheEntry *)l->data;
+	stats.bytes -= e->len, --stats.entries;
+	_entry_free(e);
+	lnklist_rm(l);
+}
+
+/*
+ * The key that url's response is cached under; free it after use. URLs are
+ * normalized, so that e.g. gemini://Example.org and
+ * gemini://example.org:1965/ share an entry.
+ */
+char *
+cache_key(CURLU *url)
+{
+	char *scheme = NULL, *host = NULL, *port = NULL;
+	char *path = NULL, *query = NULL, *key = NULL;
+
+	if (curl_url_get(url, CURLUPART_SCHEME, &scheme, 0)
+			|| curl_url_get(url, CURLUPART_HOST, &host, 0))
+		goto cleanup;
+	curl_url_get(url, CURLUPART_PORT, &port, 0);
+	curl_url_get(url, CURLUPART_PATH, &path, 0);
+	curl_url_get(url, CURLUPART_QUERY, &query, 0);
+
+	for (char *p = scheme; *p; ++p) *p = tolower(*p);
+	for (char *p = host; *p; ++p)   *p = tolower(*p);
+
+	_Bool defport = !port || !strcmp(port, "1965");
+	key = strdup(format("%s://%s%s%s%s%s%s", scheme, host,
+		defport ? "" : ":", defport ? "" : port,
+		path && *path ? path : "/",
+		query ? "?" : "", query ? query : ""));
+
+cleanup:
+	free(scheme), free(host), free(port);
+	free(path), free(query);
+	return key;
+}
+
+/*
+ * Look up a response; data still belongs to the cache. If stale is
+ * non-NULL, it's set if the response is older than c_cache_ttl, and stale
+ * responses are returned as well; otherwise they're treated as misses.
+ */
+_Bool
+cache_get(char *key, char **data, size_t *len, _Bool *stale)
+{
+	struct lnklist *l = _find(key);
+	if (!l) {
+		++stats.misses;
+		return false;
+	}
+
+	struct CacheEntry *e = (struct CacheEntry *)l->data;
+
+	struct timeval now, age;
+	ENSURE(gettimeofday(&now, NULL) == 0);
+	timersub(&now, &e->stored, &age);
+
+	_Bool old = (size_t)age.tv_sec >= c_cache_ttl;
+	if (old && !stale) {
+		++stats.misses;
+		return false;
+	}
+
+	if (stale) *stale = old;
+	if (old)   ++stats.stale;
+	++stats.hits, ++e->hits;
+
+	/* move to front */
+	lnklist_rm(l);
+	lnklist_insert(entries, (void *)e);
+
+	*data = e->data, *len = e->len;
+	return true;
+}
+
+_Bool
+cache_contains(char *key)
+{
+	return _find(key) != NULL;
+}
+
+/* store a response, taking ownership of data. */
+void
+cache_put(char *key, char *data, size_t len)
+{
+	struct lnklist *l = _find(key);
+	if (l) _evict(l);
+
+	/* don't let one response flush out everything else */
+	if (len > c_cache_bytes / 4) {
+		free(data);
+		return;
+	}
+
+	while (entries->next && stats.bytes + len > c_cache_bytes) {
+		_evict(lnklist_tail(entries));
+		++stats.evictions;
+	}
+
+	struct CacheEntry *e = ecalloc(1, sizeof(struct CacheEntry));
+	e->key = strdup(key);
+	e->data = data, e->len = len;
+	ENSURE(gettimeofday(&e->stored, NULL) == 0);
+
+	stats.bytes += len, ++stats.entries;
+	lnklist_insert(entries, (void *)e);
+}
+
+static struct lnklist *
+_find_redirect(char *key)
+{
+	if (!redirects)
+		redirects = lnklist_new();
+
+	for (struct lnklist *l = redirects->next; l; l = l->next)
+		if (!strcmp(((struct CacheRedirect *)l->data)->key, key))
+			return l;
+	return NULL;
+}
+
+static void
+_redirect_free(struct lnklist *l)
+{
+	struct CacheRedirect *r = (struct CacheRedirect *)l->data;
+	free(r->key), free(r->target), free(r);
+	lnklist_rm(l);
+	--stats.redirects;
+}
+
+/* where key was permanently redirected to, if anywhere. */
+char *
+cache_redirected(char *key)
+{
+	struct lnklist *l = _find_redirect(key);
+	if (!l) return NULL;
+
+	++stats.redirects_skipped;
+	return ((struct CacheRedirect *)l->data)->target;
+}
+
+/*
+ * Remember that key was permanently redirected to target (an absolute
+ * URL), or forget about it if target is NULL.
+ */
+void
+cache_redirect(char *key, char *target)
+{
+	struct lnklist *l = _find_redirect(key);
+	if (l) _redirect_free(l);
+	if (!target) return;
+
+	ssize_t len = lnklist_len(redirects);
+	if (len > 0 && (size_t)len >= c_cache_redirects)
+		_redirect_free(lnklist_tail(redirects));
+
+	struct CacheRedirect *r = ecalloc(1, sizeof(struct CacheRedirect));
+	r->key = strdup(key), r->target = strdup(target);
+	lnklist_insert(redirects, (void *)r);
+	++stats.redirects;
+}
+
+struct CacheStats *
+cache_stats(void)
+{
+	return &stats;
+}
+
+void
+cache_free(void)
+{
+	if (!entries) return;
+
+	for (struct lnklist *l = entries->next; l; l = l->next)
+		_entry_free((struct CacheEntry *)l->data);
+	lnklist_free(entries);
+	entries = NULL;
+
+	while (redirects && redirects->next)
+		_redirect_free(redirects->next);
+
+	stats.entries = stats.bytes = 0;
+}
@@ -0,0 +1,37 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include "curl/url.h"
+
+struct CacheEntry {
+	char *key;
+	char *data; /* the entire response, response line and all */
+	size_t len;
+
+	struct timeval stored;
+	size_t hits;
+};
+
+/* a permanent (31) redirect. */
+struct CacheRedirect {
+	char *key, *target;
+};
+
+struct CacheStats {
+	size_t entries, bytes;
+	size_t hits, misses, stale, evictions;
+	size_t redirects, redirects_skipped;
+};
+
+            char *cache_key(CURLU *url);
+            _Bool cache_get(char *key, char **data, size_t *len, _Bool *stale);
+            _Bool cache_contains(char *key);
+             void cache_put(char *key, char *data, size_t len);
+            char *cache_redirected(char *key);
+             void cache_redirect(char *key, char *target);
+struct CacheStats *cache_stats(void);
+             void cache_free(void);
+
+#endif
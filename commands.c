@@ -4,62 +4,117 @@ command_input(size_t argc, char **argv, char *rawargs)
 	UNUSED(argc);
 	UNUSED(argv);
 
+	if (!CURDOC()) return;
+
 	CURLU *c_url = curl_url_dup(CURDOC()->url);
 	curl_url_set(c_url, CURLUPART_QUERY, rawargs, CURLU_URLENCODE);
 
 	follow_link(c_url, 0);
+	curl_url_cleanup(c_url);
 }
 
-static void
-command_follow(size_t argc, char **argv, char *rawargs)
+/*
+ * Turn a :go/:newgo argument into a URL. The argument can be either a link
+ * number or a URL (with or without the gemini://). Returns NULL (after
+ * complaining, unless quiet is set) if it's neither.
+ */
+static CURLU *
+command_target(char *arg, _Bool quiet)
 {
-	UNUSED(argc);
-	UNUSED(rawargs);
-
-	/*
-	 * Both :go and :newgo are handled by this function.
-	 * If the command is :newgo, open the link in a new tab.
-	 */
-	_Bool opennew = !strcmp(argv[0], "newgo");
-
 	char *end = NULL;
-	size_t link = strtol(argv[1], &end, 0);
+	size_t link = strtol(arg, &end, 0);
 	CURLU *c_url = NULL;
 
-	if (end == argv[1]) {
+	if (end == arg) {
 		char url[4096];
 		memset(url, 0x0, sizeof(url));
 
 		/* add the missing gemini:// */
-		if (strncmp("gemini://", argv[1], sizeof("gemini://")-1)) {
-			strcpy(url, format("gemini://%s", argv[1]));
+		if (strncmp("gemini://", arg, sizeof("gemini://")-1)) {
+			strcpy(url, format("gemini://%s", arg));
 		} else {
-			strcpy(url, argv[1]);
+			strcpy(url, arg);
 		}
 
 		c_url = curl_url();
 		CURLUcode rc = curl_url_set(c_url, CURLUPART_URL, url, 0);
 		if (rc) {
 			curl_url_cleanup(c_url);
-			ui_message(UI_STOP, "Invalid URL '%s'", url);
-			return;
+			if (!quiet)
+				ui_message(UI_STOP, "Invalid URL '%s'", url);
+			return NULL;
 		}
 	} else {
-		if (!gemdoc_find_link(CURDOC(), link, NULL, &c_url)) {
-			ui_message(UI_STOP, "No such link '%zu'", link);
-			return;
+		if (!gemdoc_find_link(ui_doc(), link, NULL, &c_url)) {
+			if (!quiet)
+				ui_message(UI_STOP, "No such link '%zu'", link);
+			return NULL;
 		}
 	}
 
-	if (opennew)
-		newtab(c_url);
-	else
-		follow_link(c_url, 0);
+	return c_url;
+}
+
+static void
+command_follow(size_t argc, char **argv, char *rawargs)
+{
+	UNUSED(argc);
+	UNUSED(rawargs);
+
+	CURLU *c_url = command_target(argv[1], false);
+	if (!c_url) return;
+
+	follow_link(c_url, 0);
 
 	/* free, since follow_link takes a copy */
 	curl_url_cleanup(c_url);
 }
 
+/*
+ * Open one or more links/URLs in new tabs. Ranges of links (e.g. "3-7")
+ * are accepted as well. All the tabs load at once, in the background; if
+ * only one was opened, switch to it.
+ */
+static void
+command_newtab(size_t argc, char **argv, char *rawargs)
+{
+	UNUSED(rawargs);
+
+	struct lnklist *after = curtab;
+	size_t opened = 0;
+
+	/* argc includes one past the last argument */
+	for (size_t i = 1; i < argc - 1; ++i) {
+		size_t lo, hi;
+		CURLU *c_url;
+
+		if (strlen(argv[i]) == 0)
+			continue;
+
+		if (sscanf(argv[i], "%zu-%zu", &lo, &hi) != 2) {
+			if ((c_url = command_target(argv[i], false))) {
+				after = newtab(after, c_url), ++opened;
+				curl_url_cleanup(c_url);
+			}
+			continue;
+		}
+
+		for (size_t link = lo; link <= hi; ++link) {
+			if (!gemdoc_find_link(ui_doc(), link, NULL, &c_url)) {
+				ui_message(UI_STOP, "No such link '%zu'", link);
+				break;
+			}
+			after = newtab(after, c_url), ++opened;
+			curl_url_cleanup(c_url);
+		}
+	}
+
+	if (opened == 1)
+		curtab = after;
+	else if (opened > 1)
+		ui_message(UI_INFO, "Loading %zu tabs in the background.", opened);
+}
+
 static void
 command_vimmer(size_t argc, char **argv, char *rawargs)
 {
@@ -73,6 +128,7 @@ command_vimmer(size_t argc, char **argv, char *rawargs)
 	curl_url_set(c_url, CURLUPART_URL, url, 0);
 
 	follow_link(c_url, 0);
+	curl_url_cleanup(c_url);
 }
 
 /*
@@ -117,6 +173,100 @@ command_vers(size_t argc, char **argv, char *rawargs)
 	ui_message(UI_INFO, "mebsuta v"VERSION);
 }
 
+static void
+command_dns(size_t argc, char **argv, char *rawargs)
+{
+	UNUSED(rawargs);
+
+	if (argc < 3) {
+		size_t entries, hits, lookups;
+		dns_stats(&entries, &hits, &lookups);
+		ui_message(UI_INFO, "DNS cache: %zu hosts, %zu hits, %zu lookups",
+			entries, hits, lookups);
+		return;
+	}
+
+	char *host = argv[1], *port = strchr(argv[1], ':');
+	if (port) *port++ = '\0';
+
+	struct DnsEntry *e = dns_entry(host, port ? port : "1965");
+	if (!e) {
+		ui_message(UI_WARN, "'%s' isn't in the DNS cache.", host);
+		return;
+	}
+
+	struct timeval now, left;
+	gettimeofday(&now, NULL);
+	timersub(&e->expires, &now, &left);
+
+	ui_message(UI_INFO, "%s: %s, %zu hits, %zu lookups (last took %ldms), expires in %lds",
+		e->key, e->error ? gai_strerror(e->error) : "ok", e->hits,
+		e->lookups, e->lookup_time.tv_sec * 1000 + e->lookup_time.tv_usec / 1000,
+		left.tv_sec < 0 ? 0 : (long)left.tv_sec);
+}
+
+static void
+command_cache(size_t argc, char **argv, char *rawargs)
+{
+	UNUSED(rawargs);
+
+	if (argc >= 3 && !strcmp(argv[1], "clear")) {
+		cache_free();
+		ui_message(UI_INFO, "Cache cleared.");
+		return;
+	}
+
+	struct CacheStats *s = cache_stats();
+	ui_message(UI_INFO, "Cache: %zu responses (%zuK of %zuK), %zu hits (%zu stale), %zu misses, %zu evictions; %zu redirects (%zu skipped)",
+		s->entries, s->bytes / 1024, c_cache_bytes / 1024, s->hits,
+		s->stale, s->misses, s->evictions, s->redirects,
+		s->redirects_skipped);
+}
+
+static void
+command_offline(size_t argc, char **argv, char *rawargs)
+{
+	UNUSED(argc);
+	UNUSED(argv);
+	UNUSED(rawargs);
+
+	fetch_offline = !fetch_offline;
+	ui_message(UI_INFO, fetch_offline
+		? "Offline; pages will only be loaded from the cache."
+		: "Online.");
+}
+
+static void
+feeds_loaded(struct Gemdoc *doc, size_t fresh, size_t failed)
+{
+	hist_add(&CURTAB()->visited, doc);
+	if (failed > 0)
+		ui_message(UI_WARN, "%zu new entries; %zu feeds couldn't be fetched.",
+			fresh, failed);
+	else
+		ui_message(UI_INFO, "%zu new entries.", fresh);
+	ui_redraw();
+}
+
+/* fetch the subscribed feeds, and show what's new in the current tab. */
+static void
+command_feeds(size_t argc, char **argv, char *rawargs)
+{
+	UNUSED(argc), UNUSED(argv), UNUSED(rawargs);
+
+	if (feeds_refreshing()) {
+		ui_message(UI_WARN, "Already refreshing feeds.");
+		return;
+	}
+
+	size_t n = feeds_refresh(&feeds_loaded);
+	if (n == 0)
+		ui_message(UI_WARN, "No feeds; add their URLs to %s.",
+			feeds_path() ? feeds_path() : "c_feeds");
+	else
+		ui_message(UI_INFO, "Refreshing %zu feeds...", n);
+}
+
 typedef void(*command_func_t)(size_t argc, char **argv, char *rawargs);
 
 struct Command {
@@ -126,11 +276,15 @@ struct Command {
 	char *usage;
 } commands[] = {
 	{ "go",      &command_follow, 1,   "<link/url>" },
-	{ "newgo",   &command_follow, 1,   "<link/url>" },
+	{ "newgo",   &command_newtab, 1, "<link/url>..." },
 	{ "input",   &command_input,  1,      "<input>" },
 	{ "wq",      &command_vimmer, 0,             "" },
 	{ "launch",  &command_launch, 1, "<magic-word>" },
 	{ "version", &command_vers,   0,             "" },
+	{ "dns",     &command_dns,    0,       "[host]" },
+	{ "cache",   &command_cache,  0,      "[clear]" },
+	{ "offline", &command_offline, 0,            "" },
+	{ "feeds",   &command_feeds,  0,             "" },
 };
 
 /* TODO: use uint32_t instead of char for strings, and leverage
@@ -206,6 +360,25 @@ command_complete(char *buf, size_t curs, char *completebuf)
 			}
 		}
 	} else {
+		/*
+		 * If this is a :go/:newgo whose host has been typed out
+		 * (i.e. it's followed by a '/', or it's a link number),
+		 * start connecting while the rest is typed.
+		 */
+		if (!strncmp(buf, "go ", 3) || !strncmp(buf, "newgo ", 6)) {
+			char *host = wordstart;
+			if (!strncmp(host, "gemini://", sizeof("gemini://")-1))
+				host += sizeof("gemini://")-1;
+
+			CURLU *c_url = NULL;
+			if (isdigit(*host) || strchr(host, '/'))
+				c_url = command_target(wordstart, true);
+			if (c_url) {
+				fetch_preconnect(c_url);
+				curl_url_cleanup(c_url);
+			}
+		}
+
 		char *urlbuf;
 		struct lnklist *hist = lnklist_head(CURTAB()->visited)->next;
 		for (; hist; hist = hist->next) {
@@ -6,22 +6,154 @@
 
 #include "util.h"
 #include "curl/url.h"
+#include "fetch.h"
 #include "gemini.h"
 
 static _Bool c_automatic_redirects = true;
 static size_t  c_maximum_redirects = 5;
 
+/* timeouts (in seconds) for each stage of a request. The read timeout is
+ * reset whenever data arrives. */
+static size_t  c_connect_timeout   = 15;
+static size_t  c_handshake_timeout = 15;
+static size_t  c_read_timeout      = 30;
+
+/* number of hosts to keep TLS sessions around for (0 not to resume
+ * sessions at all). */
+static size_t  c_tls_session_cache = 64;
+
+/* how long (in seconds) to remember resolved hosts and failed lookups,
+ * and how many hosts to remember. */
+static size_t  c_dns_ttl           = 300;
+static size_t  c_dns_negative_ttl  = 30;
+static size_t  c_dns_cache_size    = 256;
+
+/* how long (in milliseconds) to give a connection attempt before racing
+ * it against the host's next address. */
+static size_t  c_connect_stagger   = 250;
+
+/* whether to start connecting to a host while a :go to it is still being
+ * typed, how long to keep such a connection if it goes unused, and how
+ * many to have at once. */
+static _Bool   c_preconnect        = true;
+static size_t  c_preconnect_idle   = 10;
+static size_t  c_preconnect_max    = 4;
+
+/* how many requests to have in flight at once, in total and to any one
+ * host. Requests beyond that wait their turn (see enum FetchPriority). */
+static size_t  c_fetch_max         = 8;
+static size_t  c_fetch_host_max    = 2;
+
+/*
+ * Hosts that reply with 44 (slow down) are left alone for as many seconds
+ * as they ask for, or c_slowdown_default if they don't say. Requests that
+ * got a 44 are retried up to c_slowdown_retries times, as long as that
+ * means waiting no more than c_slowdown_max_wait seconds.
+ */
+static size_t  c_slowdown_default  = 60;
+static size_t  c_slowdown_retries  = 2;
+static size_t  c_slowdown_max_wait = 30;
+
+/* how many lines past the bottom of the screen to read ahead while a page
+ * is loading; the rest is only read as it's scrolled to. 0 reads pages in
+ * full. Pages that weren't read in one go aren't cached. */
+static size_t  c_lazy_lookahead    = 200;
+
+/*
+ * Whether to parse gemtext on a thread of its own, while the rest of it is
+ * still coming in, and how many lines (a power of two) can be in flight
+ * between the two threads either way.
+ */
+static _Bool   c_parse_thread      = true;
+static size_t  c_parse_ring_size   = 1024;
+
+/* size of the blocks responses are received into; lines that are longer
+ * get a bigger one. */
+static size_t  c_slab_size         = 64 * 1024;
+
+/* number of threads to resolve hosts with. */
+static size_t  c_dns_workers       = 4;
+
+/*
+ * Size of the response cache (in bytes), and how long (in seconds) a
+ * cached response is considered fresh. If c_cache_swr is set, stale
+ * responses are shown right away while they're fetched again in the
+ * background ("stale-while-revalidate"); otherwise they're refetched
+ * before being shown. Reloading always refetches.
+ */
+static size_t  c_cache_bytes       = 16 * 1024 * 1024;
+static size_t  c_cache_ttl         = 300;
+static _Bool   c_cache_swr         = true;
+
+/* number of permanent (31) redirects to remember. */
+static size_t  c_cache_redirects   = 1024;
+
+/*
+ * Whether to keep responses on disk as well, under $XDG_CACHE_HOME, so
+ * that they survive restarts. Responses larger than c_store_max_response
+ * bytes aren't kept. With c_offline set (see also :offline), pages are
+ * only ever served from the cache, however old.
+ */
+static _Bool   c_store              = true;
+static size_t  c_store_max_response = 4 * 1024 * 1024;
+static _Bool   c_offline            = false;
+
+/* where to save responses that aren't text. If NULL, $XDG_DOWNLOAD_DIR,
+ * ~/Downloads, or the current directory, whichever's there. */
+static char   *c_download_dir       = NULL;
+
+/*
+ * Whether to prefetch the same-host links of each page, so that they show
+ * up instantly when followed. Each page may spend up to
+ * c_prefetch_max_requests requests and c_prefetch_max_bytes bytes, with
+ * c_prefetch_concurrency requests at a time. Hosts that have asked us to
+ * slow down aren't prefetched from.
+ */
+static _Bool   c_prefetch              = false;
+static size_t  c_prefetch_max_requests = 16;
+static size_t  c_prefetch_max_bytes    = 1024 * 1024;
+static size_t  c_prefetch_concurrency  = 2;
+
+/* how many requests a crawl (see -M) keeps in flight to the host it's
+ * crawling. Hosts that ask it to slow down are waited on, as ever. */
+static size_t  c_crawl_concurrency     = 4;
+
+/* the address the proxy (see -P) listens on, and how many requests it
+ * makes upstream at once (still at most c_fetch_host_max to a host). */
+static char   *c_proxy_address         = "127.0.0.1";
+static size_t  c_proxy_fetch_max       = 64;
+
+/*
+ * The gemlogs (or Atom feeds) that :feeds polls, one URL per line. If
+ * NULL, $XDG_CONFIG_HOME/mebsuta/feeds or ~/.config/mebsuta/feeds. They're
+ * fetched c_feeds_fetch_max at a time (still at most c_fetch_host_max to
+ * a host), and the latest c_feeds_entries entries are shown.
+ */
+static char   *c_feeds                 = NULL;
+static size_t  c_feeds_fetch_max       = 32;
+static size_t  c_feeds_entries         = 100;
+
 static char *homepage = "gemini://gemini.circumlunar.space";
 
 static char * __attribute__((unused))
-statusline(size_t width, size_t read, struct Gemdoc *g)
+statusline(size_t width, size_t read, struct Gemdoc *g, struct Fetch *f)
 {
 	char lstatus[100] = { '\0' }, rstatus[100] = { '\0' };
-	strcpy(lstatus, format("%3d%% (%s)", read, g->mimetype));
+	if (f)
+		strcpy(lstatus, format("%s... (%zu KiB, %zu KiB/s)",
+			f->saveto ? "Saving" : f->paused ? "Paused"
+				: fetch_state_name(f->state),
+			f->received / 1024, fetch_rate(f) / 1024));
+	else if (g)
+		strcpy(lstatus, format("%3d%% (%s)%s", read, g->mimetype,
+			fetch_offline ? " [offline]" : ""));
 
-	char *url;
-	curl_url_get(g->url, CURLUPART_URL, &url, 0);
-	strcpy(rstatus, format("%s", url));
+	char *url = NULL;
+	if (f)
+		curl_url_get(f->doc->url, CURLUPART_URL, &url, 0);
+	else if (g)
+		curl_url_get(g->url, CURLUPART_URL, &url, 0);
+	strcpy(rstatus, format("%s", url ? url : ""));
 	free(url);
 
 	char *pad = strrep(' ', width - strlen(lstatus) - strlen(rstatus) - 2);
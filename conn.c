@@ -1,7 +1,10 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -9,129 +12,518 @@
 #include <tls.h>
 #include <unistd.h>
 
+#include "config.h"
 #include "conn.h"
+#include "dns.h"
+#include "list.h"
+#include "strlcpy.h"
+#include "trace.h"
 #include "util.h"
 
-struct tls *client = NULL;
+/*
+ * libtls keeps (at most) one session per tls_config, in the file given to
+ * tls_config_set_session_fd(). So that repeat connections to a host can
+ * resume its session and skip a full handshake, each host:port gets its
+ * own long-lived tls_config and session file, most recently used first.
+ */
+struct Session {
+	char *key;
+	int fd;
+	struct tls_config *cfg;
+};
 
-_Bool
-conn_init(void)
+static struct lnklist *sessions = NULL;
+
+/* record an error message; if err is NULL, use errno's. */
+static void
+_set_error(struct Conn *c, const char *err)
+{
+	strlcpy(c->error, err ? err : strerror(errno), sizeof(c->error));
+}
+
+/* map a TLS_WANT_POLL{IN,OUT} return to the events we should wait for. */
+static _Bool
+_tls_want(struct Conn *c, ssize_t r)
+{
+	if (r == TLS_WANT_POLLIN)
+		c->events = POLLIN;
+	else if (r == TLS_WANT_POLLOUT)
+		c->events = POLLOUT;
+	else
+		return false;
+	return true;
+}
+
+static void
+_session_free(struct Session *s)
+{
+	/* connections that are still using the config hold their
+	 * own reference to it */
+	tls_config_free(s->cfg);
+	if (s->fd != -1) close(s->fd);
+	free(s->key);
+	free(s);
+}
+
+static struct Session *
+_session_new(char *key)
 {
-	struct tls_config *tlscfg = tls_config_new();
-	ENSURE(tlscfg);
+	struct Session *s = ecalloc(1, sizeof(struct Session));
+	s->key = strdup(key);
+	s->fd = -1;
+
+	s->cfg = tls_config_new();
+	ENSURE(s->cfg);
 
-	if (tls_config_set_ciphers(tlscfg, "compat") != 0)
-		return false; /* tls_config_set_ciphers error */
+	if (tls_config_set_ciphers(s->cfg, "compat") != 0) {
+		_session_free(s);
+		return NULL;
+	}
 
 	/* FIXME: right way to allow self-signed certs? */
-	tls_config_insecure_noverifycert(tlscfg);
+	tls_config_insecure_noverifycert(s->cfg);
 
-	client = tls_client();
-	ENSURE(client);
+	/* if we can't get a session file, we'll just do without */
+	FILE *tmp = c_tls_session_cache > 0 ? tmpfile() : NULL;
+	if (tmp) {
+		s->fd = dup(fileno(tmp));
+		fclose(tmp);
+	}
 
-	if (tls_configure(client, tlscfg) != 0)
-		return false; /* tls_configure error */
+	if (s->fd != -1 && tls_config_set_session_fd(s->cfg, s->fd) != 0)
+		close(s->fd), s->fd = -1;
 
-	tls_config_free(tlscfg);
-	return true;
+	return s;
+}
+
+static struct tls_config *
+_session_config(char *host, char *port)
+{
+	ENSURE(sessions);
+
+	char *key = format("%s:%s", host, port);
+	struct lnklist *l;
+	size_t count = 0;
+
+	for (l = sessions->next; l; l = l->next, ++count) {
+		struct Session *s = (struct Session *)l->data;
+		if (strcmp(s->key, key))
+			continue;
+
+		/* move to front */
+		lnklist_rm(l);
+		lnklist_insert(sessions, (void *)s);
+		return s->cfg;
+	}
+
+	struct Session *s = _session_new(key);
+	if (!s) return NULL;
+
+	/* the config being handed out is kept even if no sessions are,
+	 * which leaves just the one */
+	if (count > 0 && count >= c_tls_session_cache) {
+		struct lnklist *tail = lnklist_tail(sessions);
+		_session_free((struct Session *)tail->data);
+		lnklist_rm(tail);
+	}
+
+	lnklist_insert(sessions, (void *)s);
+	return s->cfg;
 }
 
 _Bool
-conn_conn(char *host, char *port)
+conn_init(void)
 {
-	ENSURE(client);
+	if (!sessions)
+		sessions = lnklist_new();
+	return sessions != NULL;
+}
 
-	struct addrinfo hints = {
-		.ai_protocol = IPPROTO_TCP,
-		.ai_socktype = SOCK_STREAM,
-		.ai_family = AF_UNSPEC,
-	};
-	struct addrinfo *res, *r;
-	int fd = -1;
+struct Conn *
+conn_new(char *host, char *port)
+{
+	struct Conn *c = ecalloc(1, sizeof(struct Conn));
+	c->fd = -1;
+	c->host = strdup(host);
+	c->port = strdup(port);
 
-	/* failed to resolve */
-	if(getaddrinfo(host, port, &hints, &res) != 0) return false;
+	c->trace = trace_open(host, port);
+	if ((c->replay = trace_replaying()))
+		return c;
 
-	for(r = res; r != NULL; r = r->ai_next) {
-		if((fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol)) == -1)
-			continue;
-		if(connect(fd, r->ai_addr, r->ai_addrlen) == 0)
-			break;
-		close(fd);
+	c->tls = tls_client();
+	ENSURE(c->tls);
+
+	struct tls_config *tlscfg = _session_config(host, port);
+	if (!tlscfg)
+		_set_error(c, "unable to set up TLS configuration");
+	else if (tls_configure(c->tls, tlscfg) != 0)
+		_set_error(c, tls_error(c->tls));
+
+	return c;
+}
+
+/*
+ * Order addresses as RFC 8305 suggests: alternate between address
+ * families, starting with whichever family the resolver put first.
+ */
+static void
+_sort_addrs(struct Conn *c, struct addrinfo *addrs)
+{
+	struct addrinfo *r;
+	size_t n = 0;
+
+	for (r = addrs; r; r = r->ai_next) ++n;
+	c->addrv = ecalloc(n ? n : 1, sizeof(struct addrinfo *));
+	c->naddrs = n, c->next = 0;
+	if (n == 0) return;
+
+	struct addrinfo *a = addrs, *b = addrs;
+	int first = addrs->ai_family;
+
+	for (size_t i = 0; i < n; ++i) {
+		/* next address of the first family, and of the others */
+		while (a && a->ai_family != first) a = a->ai_next;
+		while (b && b->ai_family == first) b = b->ai_next;
+
+		if ((i % 2 == 0 && a) || !b)
+			c->addrv[i] = a, a = a->ai_next;
+		else
+			c->addrv[i] = b, b = b->ai_next;
 	}
+}
 
-	freeaddrinfo(res);
+/*
+ * Start (or check on) the lookup of the connection's host. While it's in
+ * progress, poll(2) dns_fd() and call dns_poll() to collect the result.
+ */
+int
+conn_resolve(struct Conn *c)
+{
+	ENSURE(c);
 
-	/* can't connect */
-	if (r == NULL) return false;
+	if (c->replay)
+		return CONN_DONE;
 
-	if (tls_connect_socket(client, fd, host) != 0)
-		return false; /* tls: connect failed */
-	if (tls_handshake(client) != 0)
-		return false; /* tls: handshake failed */
+	if (!c->query)
+		c->query = dns_resolve(c->host, c->port);
 
-	return true;
+	struct addrinfo *addrs;
+	int r = dns_result(c->query, &addrs);
+	if (r == -1) {
+		return CONN_AGAIN;
+	} else if (r != 0) {
+		_set_error(c, gai_strerror(r));
+		return CONN_ERROR;
+	}
+
+	_sort_addrs(c, addrs);
+	return CONN_DONE;
 }
 
-_Bool
-conn_active(void)
+/* stop racing, keeping the ith attempt (if any) as the connection. */
+static void
+_race_finish(struct Conn *c, ssize_t winner)
 {
-	// TODO: check if connection is still open
-	return client != NULL;
+	for (size_t i = 0; i < c->nracing; ++i) {
+		if ((ssize_t)i == winner)
+			c->fd = c->racing[i];
+		else
+			close(c->racing[i]);
+	}
+	c->nracing = 0;
 }
 
-_Bool
-conn_send(char *data)
+/* start a non-blocking connect(2) to the next address. */
+static int
+_race_start(struct Conn *c, struct timeval *now)
 {
-	ENSURE(conn_active());
-	size_t len = strlen(data);
+	for (; c->next < c->naddrs; ++c->next) {
+		struct addrinfo *r = c->addrv[c->next];
+		int fd;
 
-	while (len) {
-		ssize_t r = -1;
+		if ((fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol)) == -1) {
+			_set_error(c, NULL);
+			continue;
+		}
+
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+			_set_error(c, NULL);
+			close(fd);
+			continue;
+		}
 
-		r = tls_write(client, data, len);
+		if (connect(fd, r->ai_addr, r->ai_addrlen) == 0) {
+			++c->next;
+			_race_finish(c, -1);
+			c->fd = fd;
+			return CONN_DONE;
+		}
 
-		if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT)
+		if (errno != EINPROGRESS) {
+			_set_error(c, NULL);
+			close(fd);
 			continue;
-		else if (r < 0) return false;
+		}
+
+		++c->next;
+		c->racing[c->nracing++] = fd;
 
-		data += r; len -= r;
+		c->next_attempt = *now;
+		c->next_attempt.tv_usec += c_connect_stagger * 1000;
+		while (c->next_attempt.tv_usec >= 1000000)
+			++c->next_attempt.tv_sec, c->next_attempt.tv_usec -= 1000000;
+
+		return CONN_AGAIN;
 	}
 
-	return true;
+	return CONN_ERROR;
+}
+
+/*
+ * Race non-blocking connect(2)s to the resolved addresses ("happy
+ * eyeballs", RFC 8305): start with the first address, and start another
+ * every c_connect_stagger milliseconds until one of them connects (or
+ * fails, in which case don't wait). The first to connect wins, and the
+ * others are dropped. The TLS context is then attached to the winner; the
+ * handshake itself is done by conn_handshake().
+ */
+int
+conn_connect(struct Conn *c)
+{
+	ENSURE(c);
+
+	if (c->replay)
+		return CONN_DONE;
+
+	struct timeval now;
+	ENSURE(gettimeofday(&now, NULL) == 0);
+
+	if (c->nracing > 0) {
+		struct pollfd pfds[CONN_MAXRACE];
+		size_t n = conn_pollfds(c, pfds);
+
+		if (poll(pfds, n, 0) == -1 && errno != EINTR)
+			die("poll:");
+
+		for (size_t i = n; i > 0; --i) {
+			if (pfds[i - 1].revents == 0)
+				continue;
+
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if (getsockopt(pfds[i - 1].fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+				err = errno;
+
+			if (err == 0) {
+				_race_finish(c, i - 1);
+				goto connected;
+			}
+
+			errno = err;
+			_set_error(c, NULL);
+			close(c->racing[i - 1]);
+			memmove(&c->racing[i - 1], &c->racing[i],
+				(c->nracing - i) * sizeof(*c->racing));
+			--c->nracing;
+
+			/* no sense waiting for the stagger */
+			c->next_attempt = now;
+		}
+	}
+
+	if (c->nracing < CONN_MAXRACE && (c->nracing == 0
+			|| !timercmp(&now, &c->next_attempt, <))) {
+		switch (_race_start(c, &now)) {
+		break; case CONN_DONE:
+			goto connected;
+		break; case CONN_ERROR:
+			/* out of addresses; the others might still make it */
+			if (c->nracing == 0) {
+				/* can't connect */
+				if (!c->error[0])
+					_set_error(c, "unable to connect");
+				return CONN_ERROR;
+			}
+		}
+	}
+
+	c->events = POLLOUT;
+	return CONN_AGAIN;
+
+connected:
+	if (tls_connect_socket(c->tls, c->fd, c->host) != 0) {
+		_set_error(c, tls_error(c->tls));
+		return CONN_ERROR;
+	}
+	return CONN_DONE;
 }
 
+int
+conn_handshake(struct Conn *c)
+{
+	ENSURE(c);
+
+	if (c->replay)
+		return trace_handshake(c->trace);
+
+	ssize_t r = tls_handshake(c->tls);
+
+	if (_tls_want(c, r))
+		return CONN_AGAIN;
+	else if (r != 0) {
+		_set_error(c, tls_error(c->tls));
+		trace_log(c->trace, "error", c->error, strlen(c->error));
+		return CONN_ERROR;
+	}
+
+	trace_log(c->trace, "ready", NULL, 0);
+	return CONN_DONE;
+}
+
+/*
+ * Returns the number of bytes written, 0 if the socket isn't ready, and
+ * -2 on error.
+ */
 ssize_t
-conn_recv(char *bufsrv, size_t sz)
+conn_send(struct Conn *c, char *data, size_t len)
 {
-	ssize_t r = tls_read(client, bufsrv, sz);
+	ENSURE(c);
+
+	char *error = NULL;
+	ssize_t r;
+
+	if (c->replay) {
+		if ((r = trace_send(c->trace, data, len, &error)) < 0)
+			_set_error(c, error);
+		return r;
+	}
 
-	if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT) {
+	r = tls_write(c->tls, data, len);
+
+	if (_tls_want(c, r)) {
 		return 0;
 	} else if (r < 0) {
-		if (errno != EINTR)
+		_set_error(c, tls_error(c->tls));
+		return -2;
+	}
+
+	trace_log(c->trace, "send", data, r);
+	return r;
+}
+
+/*
+ * Returns the number of bytes read, 0 if the socket isn't ready, -1 on
+ * EOF, and -2 on error.
+ */
+ssize_t
+conn_recv(struct Conn *c, char *bufsrv, size_t sz)
+{
+	ENSURE(c);
+
+	char *error = NULL;
+	ssize_t r;
+
+	if (c->replay) {
+		if ((r = trace_recv(c->trace, bufsrv, sz, &error)) == -2)
+			_set_error(c, error);
+		return r;
+	}
+
+	r = tls_read(c->tls, bufsrv, sz);
+
+	if (_tls_want(c, r)) {
+		return 0;
+	} else if (r < 0) {
+		if (errno != EINTR) {
+			_set_error(c, tls_error(c->tls));
+			trace_log(c->trace, "error", c->error, strlen(c->error));
 			return -2;
+		}
+		c->events = POLLIN;
 		return 0;
 	} else if (r == 0) {
+		trace_log(c->trace, "eof", NULL, 0);
 		return -1;
 	}
 
+	trace_log(c->trace, "recv", bufsrv, r);
 	return r;
 }
 
-_Bool
-conn_close(void)
+/* fill pfds (at least CONN_MAXRACE long) with the fds to poll(2). */
+size_t
+conn_pollfds(struct Conn *c, struct pollfd *pfds)
 {
-	ENSURE(conn_active());
-	tls_close(client);
-	return true;
+	ENSURE(c);
+
+	if (c->nracing > 0) {
+		for (size_t i = 0; i < c->nracing; ++i) {
+			pfds[i].fd = c->racing[i];
+			pfds[i].events = POLLOUT;
+			pfds[i].revents = 0;
+		}
+		return c->nracing;
+	} else if (c->fd != -1) {
+		pfds[0].fd = c->fd;
+		pfds[0].events = c->events;
+		pfds[0].revents = 0;
+		return 1;
+	}
+
+	return 0;
 }
 
-_Bool
+/* shorten a poll(2) timeout so that we don't miss the next connect(2). */
+int
+conn_timeout(struct Conn *c, int timeout)
+{
+	ENSURE(c);
+
+	if (c->replay)
+		return trace_timeout(c->trace, timeout);
+
+	if (c->nracing == 0 || c->nracing >= CONN_MAXRACE || c->next >= c->naddrs)
+		return timeout;
+
+	struct timeval now, left;
+	ENSURE(gettimeofday(&now, NULL) == 0);
+	timersub(&c->next_attempt, &now, &left);
+
+	int ms = left.tv_sec < 0 ? 0 : left.tv_sec * 1000 + left.tv_usec / 1000;
+	return timeout < 0 || ms < timeout ? ms : timeout;
+}
+
+void
+conn_close(struct Conn *c)
+{
+	if (!c) return;
+
+	_race_finish(c, -1);
+	trace_close(c->trace);
+
+	if (c->fd != -1) {
+		/* don't bother waiting for the peer's close_notify */
+		tls_close(c->tls);
+		close(c->fd);
+	}
+
+	if (c->tls) tls_free(c->tls);
+	/* the addresses belong to the query */
+	free(c->addrv);
+	dns_query_free(c->query);
+	free(c->host);
+	free(c->port);
+	free(c);
+}
+
+void
 conn_shutdown(void)
 {
-	ENSURE(client);
-	tls_free(client);
-	client = NULL;
-	return true;
+	if (!sessions) return;
+
+	for (struct lnklist *l = sessions->next; l; l = l->next)
+		_session_free((struct Session *)l->data);
+	lnklist_free(sessions);
+	sessions = NULL;
 }
@@ -1,17 +1,63 @@
 #ifndef CONN_H
 #define CONN_H
 
+#include <netdb.h>
+#include <poll.h>
 #include <stdint.h>
+#include <sys/time.h>
+#include <sys/types.h>
 #include <tls.h>
 
-extern struct tls *client;
+#include "dns.h"
 
-  _Bool conn_init(void);
-  _Bool conn_conn(char *host, char *port);
-  _Bool conn_active(void);
-  _Bool conn_send(char *data);
-ssize_t conn_recv(char *bufsrv, size_t sz);
-  _Bool conn_close(void);
-  _Bool conn_shutdown(void);
+#define CONN_ERROR  -1
+#define CONN_AGAIN   0
+#define CONN_DONE    1
+
+#define CONN_MAXRACE 4
+
+struct Trace;
+
+struct Conn {
+	int fd;
+	struct tls *tls;
+
+	char *host, *port;
+	struct DnsQuery *query;
+
+	/* addresses to try, in order (see _sort_addrs()), and the
+	 * index of the next one */
+	struct addrinfo **addrv;
+	size_t naddrs, next;
+
+	/* connection attempts that are racing each other, and when
+	 * to start the next one */
+	int racing[CONN_MAXRACE];
+	size_t nracing;
+	struct timeval next_attempt;
+
+	/* what poll(2) should wait for before the last
+	 * operation that returned CONN_AGAIN can be retried */
+	short events;
+
+	/* if we're recording a trace (or replaying one, in which case
+	 * there's no socket at all); see trace.h */
+	struct Trace *trace;
+	_Bool replay;
+
+	char error[256];
+};
+
+       _Bool conn_init(void);
+struct Conn *conn_new(char *host, char *port);
+         int conn_resolve(struct Conn *c);
+         int conn_connect(struct Conn *c);
+         int conn_handshake(struct Conn *c);
+      size_t conn_pollfds(struct Conn *c, struct pollfd *pfds);
+         int conn_timeout(struct Conn *c, int timeout);
+     ssize_t conn_send(struct Conn *c, char *data, size_t len);
+     ssize_t conn_recv(struct Conn *c, char *bufsrv, size_t sz);
+        void conn_close(struct Conn *c);
+        void conn_shutdown(void);
 
 #endif
@@ -0,0 +1,352 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "config.h"
+#include "crawl.h"
+#include "curl/url.h"
+#include "fetch.h"
+#include "gemini.h"
+#include "list.h"
+#include "util.h"
+
+/*
+ * Crawls go breadth first, with up to `concurrency' requests in flight.
+ * No URL is requested twice; the ones seen so far are kept as an
+ * open-addressed hash set of their cache keys.
+ */
+struct Queued {
+	CURLU *url;
+	size_t depth;
+};
+
+/* a request in flight */
+struct Page {
+	struct Crawl *crawl;
+	size_t depth;
+	FILE *body;
+};
+
+static char **seen = NULL;
+static size_t seen_len = 0, seen_cap = 0;
+
+static struct lnklist *queue = NULL, *queue_tail = NULL;
+static size_t inflight = 0, requested = 0;
+
+static char *scope_host = NULL, *scope_port = NULL, *scope_prefix = NULL;
+
+/* FNV-1a */
+static uint64_t
+_hash(char *s)
+{
+	uint64_t h = 0xcbf29ce484222325;
+	for (; *s; ++s)
+		h = (h ^ (unsigned char)*s) * 0x100000001b3;
+	return h;
+}
+
+/* add key (which the set takes) to the URLs seen, unless it's there. */
+static _Bool
+_see(char *key)
+{
+	if (seen_len * 2 >= seen_cap) {
+		size_t cap = seen_cap ? seen_cap * 2 : 1024;
+		char **old = seen;
+		seen = ecalloc(cap, sizeof(char *));
+
+		for (size_t i = 0; i < seen_cap; ++i) {
+			if (!old[i]) continue;
+			size_t j = _hash(old[i]) & (cap - 1);
+			while (seen[j]) j = (j + 1) & (cap - 1);
+			seen[j] = old[i];
+		}
+
+		free(old);
+		seen_cap = cap;
+	}
+
+	size_t i = _hash(key) & (seen_cap - 1);
+	for (; seen[i]; i = (i + 1) & (seen_cap - 1)) {
+		if (!strcmp(seen[i], key)) {
+			free(key);
+			return false;
+		}
+	}
+
+	seen[i] = key, ++seen_len;
+	return true;
+}
+
+static _Bool
+_in_scope(CURLU *url)
+{
+	char *scheme = NULL, *host = NULL, *port = NULL, *path = NULL;
+
+	curl_url_get(url, CURLUPART_SCHEME, &scheme, 0);
+	curl_url_get(url, CURLUPART_HOST, &host, 0);
+	curl_url_get(url, CURLUPART_PORT, &port, 0);
+	curl_url_get(url, CURLUPART_PATH, &path, 0);
+
+	_Bool in = scheme && !strcasecmp(scheme, "gemini")
+		&& host && !strcasecmp(host, scope_host)
+		&& !strcmp(port ? port : "1965", scope_port)
+		&& !strncmp(path && *path ? path : "/", scope_prefix,
+			strlen(scope_prefix));
+
+	free(scheme), free(host), free(port), free(path);
+	return in;
+}
+
+/* queue url (which the queue takes), if it's in scope and new. */
+static void
+_enqueue(struct Crawl *c, CURLU *url, size_t depth)
+{
+	char *key = NULL;
+	if ((c->depth && depth > c->depth) || !_in_scope(url)
+			|| !(key = cache_key(url)) || !_see(key)) {
+		curl_url_cleanup(url);
+		return;
+	}
+
+	struct Queued *q = ecalloc(1, sizeof(struct Queued));
+	q->url = url, q->depth = depth;
+	lnklist_insert(queue_tail, (void *)q);
+	queue_tail = queue_tail->next;
+}
+
+static void
+_crawled(struct Fetch *f)
+{
+	struct Page *p = (struct Page *)f->data;
+	struct Crawl *c = p->crawl;
+	--inflight;
+
+	if (p->body) fseek(p->body, 0, SEEK_SET);
+	if (c->page)
+		(c->page)(f, f->saveto ? p->body : NULL, c->data);
+
+	if (f->status == 0 && f->doc->type == GEM_TYPE_SUCCESS) {
+		struct lnklist *l = f->doc->document->next;
+		for (; l; l = l->next) {
+			struct Gemtok *t = (struct Gemtok *)l->data;
+			if (t->type == GEM_DATA_LINK && t->link_url)
+				_enqueue(c, curl_url_dup(t->link_url), p->depth + 1);
+		}
+	} else if (f->status == 0 && f->doc->type == GEM_TYPE_REDIRECT) {
+		/* where a page has moved to is the same distance away */
+		CURLU *url = curl_url_dup(f->doc->url);
+		if (curl_url_set(url, CURLUPART_URL, f->doc->meta, 0))
+			curl_url_cleanup(url);
+		else
+			_enqueue(c, url, p->depth);
+	}
+
+	if (p->body) fclose(p->body);
+	free(p);
+}
+
+static void
+_start(struct Crawl *c, struct Queued *q)
+{
+	struct Page *p = ecalloc(1, sizeof(struct Page));
+	p->crawl = c, p->depth = q->depth;
+
+	/* anything that isn't text is saved to a temporary file, for
+	 * c->page to deal with */
+	int flags = c->flags;
+	if (!BITSET(flags, FETCH_NOSAVE))
+		flags |= (p->body = tmpfile()) ? FETCH_SAVEFD : FETCH_NOSAVE;
+
+	struct Fetch *f = fetch_new(q->url, FETCH_PRIO_FOREGROUND, flags,
+		&_crawled, (void *)p);
+	if (p->body)
+		f->savefd = fileno(p->body);
+
+	free(q);
+	++inflight, ++requested;
+}
+
+/* crawl c, and return how many requests were made. */
+size_t
+crawl_run(struct Crawl *c)
+{
+	CURLU *url = curl_url();
+	char *path = NULL;
+
+	if (curl_url_set(url, CURLUPART_URL, c->seed, 0)
+			|| curl_url_get(url, CURLUPART_HOST, &scope_host, 0))
+		die("invalid seed URL '%s'", c->seed);
+	curl_url_get(url, CURLUPART_PORT, &scope_port, 0);
+	curl_url_get(url, CURLUPART_PATH, &path, 0);
+
+	if (!scope_port)
+		scope_port = strdup("1965");
+
+	/* by default, the seed's directory */
+	char *dir = path && *path ? path : "/", *slash = strrchr(dir, '/');
+	if (c->prefix)
+		scope_prefix = strdup(c->prefix);
+	else
+		scope_prefix = slash ? strndup(dir, slash - dir + 1) : strdup("/");
+	free(path);
+
+	queue_tail = queue = lnklist_new();
+	inflight = requested = 0;
+
+	/* the seed's always fetched, whatever the scope */
+	struct Queued *q = ecalloc(1, sizeof(struct Queued));
+	q->url = url;
+	_see(cache_key(url));
+	lnklist_insert(queue_tail, (void *)q);
+	queue_tail = queue_tail->next;
+
+	size_t concurrency = c->concurrency ? c->concurrency : c_crawl_concurrency;
+	fetch_limit(concurrency, concurrency);
+
+	while (queue->next || inflight > 0) {
+		while (queue->next && inflight < concurrency
+				&& (!c->pages || requested < c->pages)) {
+			struct lnklist *l = queue->next;
+			if (l == queue_tail)
+				queue_tail = queue;
+			_start(c, (struct Queued *)l->data);
+			lnklist_rm(l);
+		}
+
+		/* out of pages, with some still queued */
+		if (inflight == 0)
+			break;
+		fetch_poll(100);
+	}
+
+	fetch_limit(0, 0);
+
+	for (struct lnklist *l = queue->next; l; l = l->next) {
+		curl_url_cleanup(((struct Queued *)l->data)->url);
+		free(l->data);
+	}
+	lnklist_free(queue);
+	queue = queue_tail = NULL;
+
+	for (size_t i = 0; i < seen_cap; ++i)
+		free(seen[i]);
+	free(seen);
+	seen = NULL, seen_len = seen_cap = 0;
+
+	free(scope_host), free(scope_port), free(scope_prefix);
+	scope_host = scope_port = scope_prefix = NULL;
+
+	return requested;
+}
+
+/*
+ * An archive is every response in a crawl (response line and all, as
+ * they'd be cached) one after the other, and `<archive>.idx' says where
+ * each one is, with a line of
+ *
+ *     <offset> <length> <key>
+ *
+ * per response. Both are only ever appended to; if a URL's in there
+ * more than once (after a second crawl), the last one counts.
+ */
+struct Mirror {
+	char *path;
+	int fd, idx;
+	off_t offset;
+	size_t pages, failed, bytes;
+};
+
+static void
+_write_all(struct Mirror *m, int fd, char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t w = write(fd, data, len);
+		if (w == -1 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			die("unable to write to %s:", m->path);
+		data += w, len -= w;
+	}
+}
+
+static void
+_archive(struct Fetch *f, FILE *body, void *data)
+{
+	struct Mirror *m = (struct Mirror *)data;
+	char *key = cache_key(f->doc->url);
+
+	if (f->status != 0 || !key) {
+		fprintf(stderr, "crawl: %s: %s\n", key ? key : "?", f->error);
+		++m->failed;
+		free(key);
+		return;
+	}
+
+	size_t len;
+	if (body) {
+		struct stat st;
+		char *line = format("%zu %s\n", f->doc->status, f->doc->meta);
+		size_t linelen = strlen(line);
+		ENSURE(fstat(fileno(body), &st) == 0);
+
+		_write_all(m, m->fd, line, linelen);
+		char buf[64 * 1024];
+		size_t r;
+		while ((r = fread(buf, 1, sizeof(buf), body)) > 0)
+			_write_all(m, m->fd, buf, r);
+		len = linelen + st.st_size;
+	} else {
+		char *response = gemdoc_serialize(f->doc, &len);
+		_write_all(m, m->fd, response, len);
+		free(response);
+	}
+
+	char *entry = format("%lld %zu %s\n", (long long)m->offset, len, key);
+	_write_all(m, m->idx, entry, strlen(entry));
+
+	m->offset += len, m->bytes += len;
+	++m->pages;
+	free(key);
+}
+
+/*
+ * Crawl c into an archive. Returns what to exit with: non-zero if nothing
+ * was archived.
+ */
+int
+crawl_mirror(struct Crawl *c, char *archive)
+{
+	struct Mirror m = { .path = archive };
+	m.fd = open(archive, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	m.idx = open(format("%s.idx", archive),
+		O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (m.fd == -1 || m.idx == -1)
+		die("unable to open %s:", archive);
+	m.offset = lseek(m.fd, 0, SEEK_END);
+
+	c->page = &_archive, c->data = (void *)&m;
+	c->flags |= FETCH_NOCACHE | FETCH_NOSTORE | FETCH_NOTHREAD;
+
+	struct timeval start, now, took;
+	ENSURE(gettimeofday(&start, NULL) == 0);
+	crawl_run(c);
+	ENSURE(gettimeofday(&now, NULL) == 0);
+	timersub(&now, &start, &took);
+
+	double secs = took.tv_sec + took.tv_usec / 1e6;
+	fprintf(stderr, "crawl: archived %zu pages (%zu KiB), %zu failed, in %.2fs (%.1f pages/s)\n",
+		m.pages, m.bytes / 1024, m.failed, secs,
+		secs > 0 ? (m.pages + m.failed) / secs : 0);
+
+	close(m.fd), close(m.idx);
+	return m.pages == 0;
+}
@@ -0,0 +1,30 @@
+#ifndef CRAWL_H
+#define CRAWL_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "fetch.h"
+
+/*
+ * A crawl starts at `seed', and follows the links (and redirects) that
+ * stay on its host and under `prefix', up to `depth' links away. At most
+ * `pages' requests are made (0 for no limit on either).
+ */
+struct Crawl {
+	char *seed;
+	char *prefix;       /* if NULL, the seed's directory */
+	size_t depth, pages;
+	size_t concurrency; /* if 0, c_crawl_concurrency */
+	int flags;          /* for fetch_new() */
+
+	/* called with each response, successful or not. Unless `flags'
+	 * has FETCH_NOSAVE, a response that isn't text is in `body' */
+	void (*page)(struct Fetch *f, FILE *body, void *data);
+	void *data;
+};
+
+size_t crawl_run(struct Crawl *c);
+int    crawl_mirror(struct Crawl *c, char *archive);
+
+#endif
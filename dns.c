@@ -0,0 +1,355 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dns.h"
+#include "list.h"
+#include "util.h"
+
+/*
+ * Resolver cache, keyed by host:port, most recently used first.
+ * getaddrinfo(3) doesn't tell us the records' TTL, so every entry
+ * lives for c_dns_ttl (or c_dns_negative_ttl, for failed lookups).
+ *
+ * The cache, and the list of pending queries, are only ever touched
+ * from the main thread.
+ */
+static struct lnklist *cache = NULL;
+static struct lnklist *pending = NULL;
+static size_t total_hits = 0, total_lookups = 0;
+
+/*
+ * Worker pool. Queries are handed to the workers through `jobs'; once
+ * resolved, a worker writes the query's address to `done_pipe', which
+ * dns_poll() reads from.
+ */
+static struct lnklist *jobs = NULL;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+static int done_pipe[2] = { -1, -1 };
+
+static void
+_entry_free(struct DnsEntry *e)
+{
+	if (e->addrs) freeaddrinfo(e->addrs);
+	free(e->key);
+	free(e);
+}
+
+static void
+_query_free(struct DnsQuery *q)
+{
+	if (q->addrs) dns_freeaddrinfo(q->addrs);
+	free(q->key);
+	free(q->host);
+	free(q->port);
+	free(q);
+}
+
+/* copy a list of addresses, so that the caller's copy can outlive
+ * the cache entry. */
+static struct addrinfo *
+_addrinfo_dup(struct addrinfo *res)
+{
+	struct addrinfo *head = NULL, **tail = &head;
+
+	for (; res; res = res->ai_next) {
+		struct addrinfo *a = ecalloc(1, sizeof(struct addrinfo));
+		memcpy(a, res, sizeof(struct addrinfo));
+		a->ai_canonname = NULL, a->ai_next = NULL;
+		a->ai_addr = ecalloc(1, res->ai_addrlen);
+		memcpy(a->ai_addr, res->ai_addr, res->ai_addrlen);
+
+		*tail = a, tail = &a->ai_next;
+	}
+
+	return head;
+}
+
+static struct lnklist *
+_find(char *key)
+{
+	if (!cache)
+		cache = lnklist_new();
+
+	for (struct lnklist *l = cache->next; l; l = l->next)
+		if (!strcmp(((struct DnsEntry *)l->data)->key, key))
+			return l;
+	return NULL;
+}
+
+/* store the results of a finished query. */
+static void
+_cache_put(struct DnsQuery *q)
+{
+	struct lnklist *l = _find(q->key);
+	struct DnsEntry *e = l ? (struct DnsEntry *)l->data : NULL;
+
+	if (e) {
+		lnklist_rm(l);
+		if (e->addrs) freeaddrinfo(e->addrs);
+	} else {
+		e = ecalloc(1, sizeof(struct DnsEntry));
+		e->key = strdup(q->key);
+
+		ssize_t len = lnklist_len(cache);
+		if (len > 0 && (size_t)len >= c_dns_cache_size) {
+			struct lnklist *tail = lnklist_tail(cache);
+			_entry_free((struct DnsEntry *)tail->data);
+			lnklist_rm(tail);
+		}
+	}
+
+	/* the entry takes over the query's addresses */
+	e->error = q->error;
+	e->addrs = q->addrs, q->addrs = NULL;
+	timersub(&q->finished, &q->started, &e->lookup_time);
+
+	e->expires = q->finished;
+	e->expires.tv_sec += e->error ? c_dns_negative_ttl : c_dns_ttl;
+	++e->lookups, ++total_lookups;
+
+	lnklist_insert(cache, (void *)e);
+}
+
+static void *
+_worker(void *arg)
+{
+	UNUSED(arg);
+
+	struct addrinfo hints = {
+		.ai_protocol = IPPROTO_TCP,
+		.ai_socktype = SOCK_STREAM,
+		.ai_family = AF_UNSPEC,
+	};
+
+	while ("there are names to resolve") {
+		pthread_mutex_lock(&jobs_lock);
+		while (!jobs->next)
+			pthread_cond_wait(&jobs_cond, &jobs_lock);
+		struct DnsQuery *q = (struct DnsQuery *)jobs->next->data;
+		lnklist_rm(jobs->next);
+		pthread_mutex_unlock(&jobs_lock);
+
+		gettimeofday(&q->started, NULL);
+		q->error = getaddrinfo(q->host, q->port, &hints, &q->addrs);
+		if (q->error) q->addrs = NULL;
+		gettimeofday(&q->finished, NULL);
+
+		/* the pipe's write end blocks, and pointers are well
+		 * under PIPE_BUF, so this can't be a short write */
+		while (write(done_pipe[1], &q, sizeof(q)) == -1)
+			ENSURE(errno == EINTR);
+	}
+
+	return NULL;
+}
+
+static void
+_workers_init(void)
+{
+	if (jobs) return;
+
+	jobs = lnklist_new();
+	pending = lnklist_new();
+
+	ENSURE(pipe(done_pipe) == 0);
+	ENSURE(fcntl(done_pipe[0], F_SETFL, O_NONBLOCK) == 0);
+
+	for (size_t i = 0; i < c_dns_workers; ++i) {
+		/* workers stuck in getaddrinfo(3) can't be interrupted,
+		 * so don't bother waiting for them on exit */
+		pthread_t t;
+		ENSURE(pthread_create(&t, NULL, &_worker, NULL) == 0);
+		ENSURE(pthread_detach(t) == 0);
+	}
+}
+
+/*
+ * Start resolving host:port. If it's in the cache, the query is done
+ * right away; if another query for the same host is already in progress,
+ * this one waits for that lookup instead of starting its own.
+ */
+struct DnsQuery *
+dns_resolve(char *host, char *port)
+{
+	_workers_init();
+
+	struct DnsQuery *q = ecalloc(1, sizeof(struct DnsQuery));
+	q->key = strdup(format("%s:%s", host, port));
+	q->host = strdup(host);
+	q->port = strdup(port);
+
+	struct timeval now;
+	ENSURE(gettimeofday(&now, NULL) == 0);
+
+	struct lnklist *l = _find(q->key);
+	struct DnsEntry *e = l ? (struct DnsEntry *)l->data : NULL;
+
+	if (e && timercmp(&now, &e->expires, <)) {
+		++e->hits, ++total_hits;
+
+		/* move to front */
+		lnklist_rm(l);
+		lnklist_insert(cache, (void *)e);
+
+		q->error = e->error;
+		q->addrs = e->error ? NULL : _addrinfo_dup(e->addrs);
+		q->done = true;
+		return q;
+	}
+
+	for (l = pending->next; l; l = l->next) {
+		struct DnsQuery *p = (struct DnsQuery *)l->data;
+		if (!p->waiting && !strcmp(p->key, q->key)) {
+			q->waiting = true;
+			break;
+		}
+	}
+
+	lnklist_push(pending, (void *)q);
+
+	if (!q->waiting) {
+		pthread_mutex_lock(&jobs_lock);
+		lnklist_push(jobs, (void *)q);
+		pthread_cond_signal(&jobs_cond);
+		pthread_mutex_unlock(&jobs_lock);
+	}
+
+	return q;
+}
+
+/*
+ * Returns 0 and sets *res (which the query keeps ownership of) if the
+ * lookup succeeded, getaddrinfo(3)'s error if it didn't, or -1 if the
+ * query isn't done yet.
+ */
+int
+dns_result(struct DnsQuery *q, struct addrinfo **res)
+{
+	ENSURE(q);
+
+	if (!q->done)
+		return -1;
+
+	*res = q->addrs;
+	return q->error;
+}
+
+void
+dns_query_free(struct DnsQuery *q)
+{
+	if (!q) return;
+
+	/* a worker might still be using it; dns_poll() will free it
+	 * once the lookup's finished */
+	if (!q->done)
+		q->abandoned = true;
+	else
+		_query_free(q);
+}
+
+/* the fd to poll(2) for finished lookups, or -1 if there are none pending. */
+int
+dns_fd(void)
+{
+	if (!pending || !pending->next)
+		return -1;
+	return done_pipe[0];
+}
+
+/*
+ * Collect any finished lookups, cache them, and complete their queries
+ * (and any waiting on them). Returns the number of lookups collected.
+ */
+size_t
+dns_poll(void)
+{
+	if (!pending) return 0;
+
+	struct DnsQuery *q;
+	size_t collected = 0;
+
+	while (read(done_pipe[0], &q, sizeof(q)) == sizeof(q)) {
+		++collected;
+		_cache_put(q);
+
+		struct lnklist *l, *next;
+		struct DnsEntry *e = (struct DnsEntry *)_find(q->key)->data;
+
+		for (l = pending->next; l; l = next) {
+			next = l->next;
+
+			struct DnsQuery *p = (struct DnsQuery *)l->data;
+			if (p != q && (!p->waiting || strcmp(p->key, q->key)))
+				continue;
+
+			if (p != q) {
+				p->error = e->error;
+				p->addrs = e->error ? NULL : _addrinfo_dup(e->addrs);
+				p->finished = q->finished;
+			} else {
+				p->addrs = e->error ? NULL : _addrinfo_dup(e->addrs);
+			}
+
+			p->done = true;
+			lnklist_rm(l);
+
+			/* q's still needed by the rest of the loop */
+			if (p != q && p->abandoned)
+				_query_free(p);
+		}
+
+		if (q->abandoned)
+			_query_free(q);
+	}
+
+	return collected;
+}
+
+/* find the cache entry for host:port, for its statistics. */
+struct DnsEntry *
+dns_entry(char *host, char *port)
+{
+	struct lnklist *l = _find(format("%s:%s", host, port));
+	return l ? (struct DnsEntry *)l->data : NULL;
+}
+
+void
+dns_stats(size_t *entries, size_t *hits, size_t *lookups)
+{
+	ssize_t len = cache ? lnklist_len(cache) : 0;
+	*entries = len > 0 ? (size_t)len : 0;
+	*hits = total_hits, *lookups = total_lookups;
+}
+
+void
+dns_freeaddrinfo(struct addrinfo *res)
+{
+	while (res) {
+		struct addrinfo *next = res->ai_next;
+		free(res->ai_addr);
+		free(res);
+		res = next;
+	}
+}
+
+void
+dns_flush(void)
+{
+	if (!cache) return;
+
+	for (struct lnklist *l = cache->next; l; l = l->next)
+		_entry_free((struct DnsEntry *)l->data);
+	lnklist_free(cache);
+	cache = NULL;
+}
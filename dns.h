@@ -0,0 +1,45 @@
+#ifndef DNS_H
+#define DNS_H
+
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+struct DnsEntry {
+	char *key;
+
+	/* a failed lookup is cached as well, with addrs set to NULL and
+	 * error set to getaddrinfo(3)'s return value */
+	int error;
+	struct addrinfo *addrs;
+	struct timeval expires;
+
+	size_t hits, lookups;
+	struct timeval lookup_time; /* how long the last lookup took */
+};
+
+/*
+ * A pending lookup. Lookups that miss the cache are handed to a pool of
+ * worker threads; dns_poll() collects their results on the main thread,
+ * at which point `done' is set.
+ */
+struct DnsQuery {
+	char *key, *host, *port;
+	_Bool done, abandoned, waiting;
+
+	int error;
+	struct addrinfo *addrs;
+	struct timeval started, finished;
+};
+
+struct DnsQuery *dns_resolve(char *host, char *port);
+             int dns_result(struct DnsQuery *q, struct addrinfo **res);
+            void dns_query_free(struct DnsQuery *q);
+             int dns_fd(void);
+          size_t dns_poll(void);
+struct DnsEntry *dns_entry(char *host, char *port);
+            void dns_stats(size_t *entries, size_t *hits, size_t *lookups);
+            void dns_freeaddrinfo(struct addrinfo *res);
+            void dns_flush(void);
+
+#endif
@@ -0,0 +1,341 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "curl/url.h"
+#include "dump.h"
+#include "fetch.h"
+#include "gemini.h"
+#include "list.h"
+#include "util.h"
+
+/*
+ * Fetch a batch of URLs, and write each out (rendered as asked) to
+ * stdout. They're all fetched at once, within the limit, but are written
+ * out in order; one that comes in early waits, rendered, for the ones
+ * before it. Failures go to stderr (and, as JSON, to stdout too, so that
+ * there's a line for every URL).
+ */
+struct Job {
+	char *input;        /* as it was given */
+	size_t redirects;
+	_Bool done;
+
+	char *out;          /* what to write, once it's this one's turn */
+	size_t len;
+	char *error;        /* or why there's nothing to write */
+};
+
+static struct Dump *dump = NULL;
+static size_t inflight = 0;
+
+static const char *token_types[] = {
+	[GEM_DATA_HEADER1]   = "heading1", [GEM_DATA_HEADER2] = "heading2",
+	[GEM_DATA_HEADER3]   = "heading3", [GEM_DATA_TEXT]    = "text",
+	[GEM_DATA_LIST]      = "list",     [GEM_DATA_QUOTE]   = "quote",
+	[GEM_DATA_LINK]      = "link",     [GEM_DATA_PREFORMAT] = "preformat",
+};
+
+static void
+_json_string(FILE *fp, char *s)
+{
+	fputc('"', fp);
+	for (; s && *s; ++s) {
+		switch (*s) {
+		break; case '"':  fputs("\\\"", fp);
+		break; case '\\': fputs("\\\\", fp);
+		break; case '\n': fputs("\\n", fp);
+		break; case '\t': fputs("\\t", fp);
+		break; case '\r': fputs("\\r", fp);
+		break; default:
+			/* only control characters; UTF-8 goes through as is */
+			if ((unsigned char)*s < 0x20)
+				fprintf(fp, "\\u%04x", (unsigned char)*s);
+			else
+				fputc(*s, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+static void
+_render_json(FILE *fp, char *input, struct Gemdoc *g, char *error)
+{
+	fputs("{\"url\":", fp);
+	_json_string(fp, input);
+
+	if (error) {
+		fputs(",\"error\":", fp);
+		_json_string(fp, error);
+		fputs("}\n", fp);
+		return;
+	}
+
+	fprintf(fp, ",\"status\":%zu,\"meta\":", g->status);
+	_json_string(fp, g->meta);
+	fputs(",\"tokens\":[", fp);
+
+	if (g->format == GEM_FORMAT_GEMTEXT) {
+		for (struct lnklist *l = g->document->next; l; l = l->next) {
+			struct Gemtok *t = (struct Gemtok *)l->data;
+			fprintf(fp, "%s{\"type\":\"%s\",\"text\":",
+				l == g->document->next ? "" : ",", token_types[t->type]);
+			_json_string(fp, t->text ? t->text : "");
+
+			char *url = NULL;
+			if (t->type == GEM_DATA_LINK && t->link_url
+					&& !curl_url_get(t->link_url, CURLUPART_URL, &url, 0)) {
+				fputs(",\"url\":", fp);
+				_json_string(fp, url);
+			}
+			free(url);
+			fputc('}', fp);
+		}
+	} else {
+		/* the lines after the response line */
+		for (struct lnklist *l = g->rawdoc->next->next; l; l = l->next) {
+			fprintf(fp, "%s{\"type\":\"text\",\"text\":",
+				l == g->rawdoc->next->next ? "" : ",");
+			_json_string(fp, (char *)l->data);
+			fputc('}', fp);
+		}
+	}
+
+	fputs("]}\n", fp);
+}
+
+/* as the page is shown, without the styling; links are listed at the end. */
+static void
+_render_text(FILE *fp, struct Gemdoc *g, size_t width)
+{
+	if (g->format != GEM_FORMAT_GEMTEXT) {
+		for (struct lnklist *l = g->rawdoc->next->next; l; l = l->next)
+			fprintf(fp, "%s\n", (char *)l->data);
+		return;
+	}
+
+	char *prefixes[9] = {
+		[GEM_DATA_HEADER1] = "# ", [GEM_DATA_HEADER2] = "## ",
+		[GEM_DATA_HEADER3] = "### ", [GEM_DATA_LIST] = " * ",
+		[GEM_DATA_QUOTE]   = " > ",
+	};
+
+	size_t links = 0;
+	for (struct lnklist *l = g->document->next; l; l = l->next) {
+		struct Gemtok *t = (struct Gemtok *)l->data;
+		char *text = t->text ? t->text : "", prefix[32];
+
+		if (t->type == GEM_DATA_LINK) {
+			snprintf(prefix, sizeof(prefix), "[%zu] ", ++links);
+			if (!t->text) text = t->raw_link_url;
+		} else {
+			strcpy(prefix, prefixes[t->type] ? prefixes[t->type] : "");
+		}
+
+		size_t plen = strlen(prefix), fold = strlen(text);
+		if (width && t->type != GEM_DATA_PREFORMAT)
+			fold = width > plen + 1 ? width - plen : 1;
+
+		size_t i = 0;
+		struct lnklist *folded = strfold(text, fold);
+		for (struct lnklist *f = folded->next; f; f = f->next, ++i) {
+			if (i == 0 || t->type == GEM_DATA_QUOTE)
+				fprintf(fp, "%s%s\n", prefix, (char *)f->data);
+			else
+				fprintf(fp, "%*s%s\n", (int)plen, "", (char *)f->data);
+		}
+		lnklist_free_all(folded);
+	}
+
+	if (links == 0)
+		return;
+
+	fputc('\n', fp);
+	links = 0;
+	for (struct lnklist *l = g->document->next; l; l = l->next) {
+		struct Gemtok *t = (struct Gemtok *)l->data;
+		if (t->type != GEM_DATA_LINK)
+			continue;
+
+		char *url = NULL;
+		if (t->link_url)
+			curl_url_get(t->link_url, CURLUPART_URL, &url, 0);
+		fprintf(fp, "[%zu] %s\n", ++links, url ? url : t->raw_link_url);
+		free(url);
+	}
+}
+
+static void
+_render(struct Job *j, struct Gemdoc *g)
+{
+	FILE *fp = open_memstream(&j->out, &j->len);
+	ENSURE(fp);
+
+	switch (dump->format) {
+	break; case DUMP_GEMTEXT:;
+		/* everything after the response line */
+		size_t len;
+		char *response = gemdoc_serialize(g, &len), *body = strchr(response, '\n');
+		body = body ? body + 1 : response + len;
+		fwrite(body, 1, len - (body - response), fp);
+		free(response);
+	break; case DUMP_TEXT:
+		_render_text(fp, g, dump->width);
+	break; case DUMP_JSON:
+		_render_json(fp, j->input, g, j->error);
+	}
+
+	fclose(fp);
+}
+
+static void _issue(struct Job *j, CURLU *url);
+
+static void
+_fetched(struct Fetch *f)
+{
+	struct Job *j = (struct Job *)f->data;
+	struct Gemdoc *g = f->doc;
+	--inflight;
+
+	if (f->status != 0) {
+		j->error = strdup(f->error);
+	} else if (g->type == GEM_TYPE_REDIRECT) {
+		CURLU *url = curl_url_dup(g->url);
+		if (c_automatic_redirects && j->redirects < c_maximum_redirects
+				&& !curl_url_set(url, CURLUPART_URL, g->meta, 0)) {
+			++j->redirects;
+			_issue(j, url);
+			return;
+		}
+		curl_url_cleanup(url);
+		j->error = strdup(format("%zu redirect to %s", g->status, g->meta));
+	} else if (g->type != GEM_TYPE_SUCCESS) {
+		j->error = strdup(format("%zu %s", g->status, g->meta));
+	}
+
+	if (!j->error)
+		_render(j, g);
+	j->done = true;
+}
+
+static void
+_issue(struct Job *j, CURLU *url)
+{
+	fetch_new(url, FETCH_PRIO_FOREGROUND, FETCH_NOSAVE | FETCH_NOSTORE,
+		&_fetched, (void *)j);
+	++inflight;
+}
+
+static void
+_start(struct Job *j)
+{
+	CURLU *url = curl_url();
+	if (curl_url_set(url, CURLUPART_URL, strstr(j->input, "://")
+			? j->input : format("gemini://%s", j->input), 0)) {
+		curl_url_cleanup(url);
+		j->error = strdup("invalid URL");
+		j->done = true;
+		return;
+	}
+	_issue(j, url);
+}
+
+/* returns false if stdout's gone. */
+static _Bool
+_write(struct Job *j)
+{
+	if (j->error) {
+		fprintf(stderr, "mebs: %s: %s\n", j->input, j->error);
+		if (dump->format == DUMP_JSON)
+			_render(j, NULL);
+	}
+
+	if (j->len > 0)
+		fwrite(j->out, 1, j->len, stdout);
+	fflush(stdout);
+
+	free(j->out), free(j->error);
+	j->out = j->error = NULL;
+	return !ferror(stdout);
+}
+
+static void
+_read_urls(struct Dump *d)
+{
+	char *line = NULL;
+	size_t sz = 0, cap = 0;
+
+	while (getline(&line, &sz, stdin) != -1) {
+		char *s = line, *end = line + strlen(line);
+		while (isspace(*s)) ++s;
+		while (end > s && isspace(end[-1])) *--end = '\0';
+		if (!*s || *s == '#')
+			continue;
+
+		if (d->nurls == cap) {
+			cap = cap ? cap * 2 : 64;
+			ENSURE((d->urls = realloc(d->urls, cap * sizeof(char *))));
+		}
+		d->urls[d->nurls++] = strdup(s);
+	}
+
+	free(line);
+}
+
+/*
+ * Dump d's URLs to stdout. Returns what to exit with: non-zero if any of
+ * them couldn't be.
+ */
+int
+dump_run(struct Dump *d)
+{
+	_Bool from_stdin = d->nurls == 0;
+	if (from_stdin) {
+		d->urls = NULL;
+		_read_urls(d);
+	}
+
+	dump = d;
+	struct Job *jobs = ecalloc(d->nurls + 1, sizeof(struct Job));
+	for (size_t i = 0; i < d->nurls; ++i)
+		jobs[i].input = d->urls[i];
+
+	size_t concurrency = d->concurrency ? d->concurrency : c_fetch_max;
+	fetch_limit(concurrency, 0);
+
+	size_t next = 0, started = 0, failed = 0;
+	_Bool ok = true;
+
+	while (ok && next < d->nurls) {
+		while (started < d->nurls && inflight < concurrency)
+			_start(&jobs[started++]);
+
+		/* write out whatever's next in line */
+		for (; ok && next < d->nurls && jobs[next].done; ++next) {
+			failed += jobs[next].error != NULL;
+			ok = _write(&jobs[next]);
+		}
+
+		if (inflight > 0)
+			fetch_poll(100);
+	}
+
+	fetch_limit(0, 0);
+
+	/* if stdout went away, there may be some left */
+	for (size_t i = next; i < d->nurls; ++i)
+		free(jobs[i].out), free(jobs[i].error);
+	free(jobs);
+
+	if (from_stdin) {
+		for (size_t i = 0; i < d->nurls; ++i)
+			free(d->urls[i]);
+		free(d->urls);
+		d->urls = NULL, d->nurls = 0;
+	}
+
+	return !ok || failed > 0;
+}
@@ -0,0 +1,27 @@
+#ifndef DUMP_H
+#define DUMP_H
+
+#include <sys/types.h>
+
+enum DumpFormat {
+	DUMP_GEMTEXT, /* the body, as it came */
+	DUMP_TEXT,    /* wrapped, with numbered links */
+	DUMP_JSON,    /* a line of JSON per URL, with its tokens */
+};
+
+/*
+ * What to dump, and how. The URLs are fetched `concurrency' at a time (0
+ * for c_fetch_max), and written out in the order they were given in. If
+ * there aren't any, they're read from stdin, one per line.
+ */
+struct Dump {
+	char **urls;
+	size_t nurls;
+	enum DumpFormat format;
+	size_t width;       /* to wrap DUMP_TEXT at (0 not to) */
+	size_t concurrency;
+};
+
+int dump_run(struct Dump *d);
+
+#endif
@@ -0,0 +1,692 @@
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utf8proc.h>
+
+#include "config.h"
+#include "curl/url.h"
+#include "feeds.h"
+#include "fetch.h"
+#include "gemini.h"
+#include "list.h"
+#include "store.h"
+#include "strlcpy.h"
+#include "util.h"
+
+/*
+ * Feeds are gemlog indices, whose entries are links that start with a
+ * date, in the Gemini subscription convention:
+ *
+ *     => url YYYY-MM-DD title
+ *
+ * or Atom feeds. They're all fetched at once, and their entries merged
+ * into one page, newest first.
+ *
+ * What's been seen is logged to `feeds' in the store, as
+ *
+ *     feed <hash> <url> <title>
+ *     entry <first seen> <date> <feed url> <url> <title>
+ *
+ * lines, the last line for a feed (or entry) being the one that counts.
+ * A feed whose response hashes the same as when it was last looked
+ * through isn't looked through again. Without the store, all this is only
+ * kept until mebsuta exits.
+ */
+
+#define TITLE_MAX 200
+
+struct Feed {
+	char *url;
+	char title[TITLE_MAX + 1];
+	uint64_t hash;           /* of the response last looked through */
+	struct lnklist *entries; /* most recently seen first */
+
+	/* for the current refresh */
+	_Bool subscribed;
+	size_t redirects;
+	FILE *body;
+	char error[256];         /* why it couldn't be fetched, if it couldn't */
+};
+
+struct FeedEntry {
+	struct Feed *feed;
+	char *url;
+	char date[11];
+	char title[TITLE_MAX + 1];
+	time_t seen;             /* when it was first seen */
+	_Bool fresh;             /* first seen in the current refresh */
+};
+
+static struct lnklist *feeds = NULL;
+static int log_fd = -1;
+
+static time_t refreshed = 0;
+static size_t pending = 0, failed = 0;
+static feeds_func_t done = NULL;
+
+/* FNV-1a */
+static uint64_t
+_hash(char *data, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325;
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)data[i]) * 0x100000001b3;
+	return h;
+}
+
+static _Bool
+_is_date(char *s)
+{
+	for (size_t i = 0; i < 10; ++i)
+		if (i == 4 || i == 7 ? s[i] != '-' : !isdigit(s[i]))
+			return false;
+	return true;
+}
+
+/* decode the XML entity at *s (moving past it) into out, and return how
+ * many bytes it took. Anything unknown is left as is. */
+static size_t
+_entity(char **s, char *out)
+{
+	static const struct { char *name; char c; } named[] = {
+		{ "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' },
+		{ "&quot;", '"' }, { "&apos;", '\'' },
+	};
+
+	for (size_t i = 0; i < SIZEOF(named); ++i) {
+		if (!strncmp(*s, named[i].name, strlen(named[i].name))) {
+			*s += strlen(named[i].name);
+			*out = named[i].c;
+			return 1;
+		}
+	}
+
+	if ((*s)[1] == '#') {
+		_Bool hex = (*s)[2] == 'x' || (*s)[2] == 'X';
+		char *digits = *s + 2 + hex, *end;
+		long cp = strtol(digits, &end, hex ? 16 : 10);
+
+		if (end > digits && *end == ';' && cp > 0
+				&& utf8proc_codepoint_valid(cp)) {
+			*s = end + 1;
+			return utf8proc_encode_char(cp, (utf8proc_uint8_t *)out);
+		}
+	}
+
+	*out = *(*s)++;
+	return 1;
+}
+
+/*
+ * Copy s into dst, with its whitespace squeezed and trimmed. If xml is
+ * set, markup is dropped and entities (and CDATA sections) undone.
+ */
+static void
+_clean(char *dst, size_t sz, char *s, _Bool xml)
+{
+	size_t n = 0;
+	_Bool space = false, cdata = false;
+
+	/* room for a space, and the longest of characters */
+	while (*s && n + 5 < sz) {
+		if (xml && !cdata && !strncmp(s, "<![CDATA[", 9)) {
+			cdata = true, s += 9;
+		} else if (xml && cdata && !strncmp(s, "]]>", 3)) {
+			cdata = false, s += 3;
+		} else if (xml && !cdata && *s == '<') {
+			char *gt = strchr(s, '>');
+			s = gt ? gt + 1 : s + strlen(s);
+		} else if (isspace(*s)) {
+			space = n > 0, ++s;
+		} else {
+			if (space)
+				dst[n++] = ' ', space = false;
+			if (xml && !cdata && *s == '&')
+				n += _entity(&s, &dst[n]);
+			else
+				dst[n++] = *s++;
+		}
+	}
+
+	/* don't leave half a character at the end */
+	if (*s)
+		while (n > 0 && (dst[n - 1] & 0x80))
+			if ((dst[--n] & 0xC0) != 0x80)
+				break;
+	dst[n] = '\0';
+}
+
+static struct Feed *
+_feed(char *url)
+{
+	for (struct lnklist *l = feeds->next; l; l = l->next)
+		if (!strcmp(((struct Feed *)l->data)->url, url))
+			return (struct Feed *)l->data;
+
+	struct Feed *fd = ecalloc(1, sizeof(struct Feed));
+	fd->url = strdup(url);
+	fd->entries = lnklist_new();
+	lnklist_push(feeds, (void *)fd);
+	return fd;
+}
+
+/*
+ * Add (or update) one of fd's entries. Returns it, or NULL if it was
+ * already there as it is; *added is set if it's new.
+ */
+static struct FeedEntry *
+_entry(struct Feed *fd, char *url, char *date, char *title, time_t seen,
+		_Bool *added)
+{
+	struct FeedEntry *e = NULL;
+	for (struct lnklist *l = fd->entries->next; l && !e; l = l->next)
+		if (!strcmp(((struct FeedEntry *)l->data)->url, url))
+			e = (struct FeedEntry *)l->data;
+
+	if (e && !strncmp(e->date, date, 10) && !strcmp(e->title, title))
+		return NULL;
+
+	if ((*added = !e)) {
+		e = ecalloc(1, sizeof(struct FeedEntry));
+		e->feed = fd, e->url = strdup(url), e->seen = seen;
+		lnklist_insert(fd->entries, (void *)e);
+	}
+
+	memcpy(e->date, date, 10);
+	strlcpy(e->title, title, sizeof(e->title));
+	return e;
+}
+
+static void
+_log(char *line)
+{
+	if (log_fd != -1)
+		write(log_fd, line, strlen(line));
+}
+
+/* fields are separated by a space, and the title (the last) may have
+ * spaces of its own */
+static void
+_parse_line(char *line)
+{
+	char *f[6];
+	size_t n = 0, fields = !strncmp(line, "feed ", 5) ? 4 : 6;
+	for (char *s = line; n < fields && s; ++n)
+		f[n] = strsep(&s, n + 1 < fields ? " " : "");
+
+	if (n >= 3 && !strcmp(f[0], "feed")) {
+		struct Feed *fd = _feed(f[2]);
+		fd->hash = strtoull(f[1], NULL, 16);
+		strlcpy(fd->title, n > 3 ? f[3] : "", sizeof(fd->title));
+	} else if (n >= 5 && !strcmp(f[0], "entry") && _is_date(f[2])) {
+		_Bool added;
+		_entry(_feed(f[3]), f[4], f[2], n > 5 ? f[5] : "",
+			(time_t)strtoll(f[1], NULL, 10), &added);
+	}
+}
+
+/* a feed's new entries are only news if it's been looked through before */
+static void
+_add(struct Feed *fd, CURLU *link, char *date, char *title, _Bool first)
+{
+	char *url = NULL;
+	if (curl_url_get(link, CURLUPART_URL, &url, 0) || strpbrk(url, " \t\n")) {
+		free(url);
+		return;
+	}
+
+	_Bool added;
+	struct FeedEntry *e = _entry(fd, url, date, title, refreshed, &added);
+	if (e && added && !first)
+		e->fresh = true;
+
+	if (e)
+		_log(format("entry %lld %.10s %s %s %s\n", (long long)e->seen,
+			date, fd->url, url, e->title));
+	free(url);
+}
+
+static void
+_read_gemtext(struct Feed *fd, struct Gemdoc *doc, _Bool first)
+{
+	char title[TITLE_MAX + 1];
+	*fd->title = '\0';
+
+	for (struct lnklist *l = doc->document->next; l; l = l->next) {
+		struct Gemtok *t = (struct Gemtok *)l->data;
+
+		if (t->type == GEM_DATA_HEADER1 && !*fd->title)
+			_clean(fd->title, sizeof(fd->title), t->text, false);
+		if (t->type != GEM_DATA_LINK || !t->link_url || !t->text
+				|| strlen(t->text) < 10 || !_is_date(t->text))
+			continue;
+
+		/* there's often a " - " or ": " between the date and title */
+		char *s = t->text + 10;
+		while (*s && (isblank(*s) || *s == '-' || *s == ':'))
+			++s;
+
+		_clean(title, sizeof(title), s, false);
+		_add(fd, t->link_url, t->text, title, first);
+	}
+}
+
+/*
+ * Find the first <name> element after s, and copy its text to dst. Returns
+ * where the element ends, or NULL if there isn't one.
+ */
+static char *
+_element(char *s, char *name, char *dst, size_t sz)
+{
+	char open[32], close[32];
+	snprintf(open, sizeof(open), "<%s", name);
+	snprintf(close, sizeof(close), "</%s>", name);
+
+	for (; (s = strstr(s, open)); s += strlen(open)) {
+		char c = s[strlen(open)];
+		if (c == '>' || isspace(c))
+			break;
+	}
+	if (!s || !(s = strchr(s, '>')))
+		return NULL;
+
+	char *end = strstr(++s, close);
+	if (!end)
+		return NULL;
+
+	*end = '\0';
+	_clean(dst, sz, s, true);
+	*end = '<';
+	return end + strlen(close);
+}
+
+/* the value of attribute `name' in tag (which ends at a NUL), in dst. */
+static _Bool
+_attribute(char *tag, char *name, char *dst, size_t sz)
+{
+	size_t len = strlen(name);
+	for (char *s = tag; (s = strstr(s, name)); s += len) {
+		if (!isspace(s[-1]) || s[len] != '=' || !strchr("\"'", s[len + 1]))
+			continue;
+
+		char *value = s + len + 2, *end = strchr(value, s[len + 1]);
+		if (!end)
+			return false;
+
+		*end = '\0';
+		_clean(dst, sz, value, true);
+		*end = s[len + 1];
+		return true;
+	}
+	return false;
+}
+
+static void
+_read_atom(struct Feed *fd, CURLU *base, char *body, _Bool first)
+{
+	char title[TITLE_MAX + 1], date[64], href[2048], rel[64];
+
+	char *entry = strstr(body, "<entry");
+	if (entry) *entry = '\0';
+	if (!_element(body, "title", fd->title, sizeof(fd->title)))
+		*fd->title = '\0';
+	if (entry) *entry = '<';
+
+	while (entry) {
+		char *end = strstr(entry, "</entry>");
+		if (!end)
+			break;
+		*end = '\0';
+
+		/* the entry's own page, rather than e.g. its comments */
+		*href = '\0';
+		for (char *s = entry; (s = strstr(s, "<link")); ++s) {
+			char *gt = strchr(s, '>');
+			if (!gt)
+				break;
+			*gt = '\0';
+			_Bool alternate = !_attribute(s, "rel", rel, sizeof(rel))
+				|| !strcmp(rel, "alternate");
+			if (!alternate || !_attribute(s, "href", href, sizeof(href)))
+				*href = '\0';
+			*gt = '>';
+			if (*href)
+				break;
+		}
+
+		if (!_element(entry, "published", date, sizeof(date)))
+			_element(entry, "updated", date, sizeof(date));
+		if (!_element(entry, "title", title, sizeof(title)))
+			*title = '\0';
+
+		CURLU *link = curl_url_dup(base);
+		if (*href && strlen(date) >= 10 && _is_date(date)
+				&& !curl_url_set(link, CURLUPART_URL, href, 0))
+			_add(fd, link, date, title, first);
+		curl_url_cleanup(link);
+
+		*end = '<';
+		entry = strstr(end, "<entry");
+	}
+}
+
+/* f's body (without the response line), NUL-terminated. */
+static char *
+_body(struct Fetch *f, FILE *fp, size_t *len)
+{
+	struct stat st;
+	if (f->saveto && fp && fstat(fileno(fp), &st) == 0) {
+		char *body = ecalloc(st.st_size + 1, 1);
+		fseek(fp, 0, SEEK_SET);
+		*len = fread(body, 1, st.st_size, fp);
+		return body;
+	}
+
+	size_t slen;
+	char *s = gemdoc_serialize(f->doc, &slen), *b = strchr(s, '\n');
+	b = b ? b + 1 : s + slen;
+	*len = slen - (b - s);
+	memmove(s, b, *len);
+	s[*len] = '\0';
+	return s;
+}
+
+static void
+_read(struct Feed *fd, struct Fetch *f)
+{
+	size_t len;
+	char *body = _body(f, fd->body, &len);
+	uint64_t hash = _hash(body, len);
+
+	if (hash == fd->hash) {
+		free(body);
+		return;
+	}
+
+	_Bool first = fd->hash == 0;
+	if (f->saveto || strstr(f->doc->mimetype, "xml"))
+		_read_atom(fd, f->doc->url, body, first);
+	else if (f->doc->format == GEM_FORMAT_GEMTEXT)
+		_read_gemtext(fd, f->doc, first);
+
+	fd->hash = hash;
+	_log(format("feed %016" PRIx64 " %s %s\n", hash, fd->url, fd->title));
+	free(body);
+}
+
+static int
+_cmp_entries(const void *a, const void *b)
+{
+	struct FeedEntry *x = *(struct FeedEntry **)a;
+	struct FeedEntry *y = *(struct FeedEntry **)b;
+	int c = strcmp(y->date, x->date);
+	return c ? c : strcmp(x->url, y->url);
+}
+
+/* the merged document, and how many of its entries are new. */
+static struct Gemdoc *
+_render(size_t *fresh)
+{
+	size_t nentries = 0, nfeeds = 0;
+	for (struct lnklist *l = feeds->next; l; l = l->next) {
+		struct Feed *fd = (struct Feed *)l->data;
+		if (fd->subscribed)
+			nentries += lnklist_len(fd->entries), ++nfeeds;
+	}
+
+	struct FeedEntry **sorted = ecalloc(nentries + 1, sizeof(struct FeedEntry *));
+	size_t n = 0;
+	for (struct lnklist *l = feeds->next; l; l = l->next) {
+		struct Feed *fd = (struct Feed *)l->data;
+		if (!fd->subscribed) continue;
+		for (struct lnklist *e = fd->entries->next; e; e = e->next)
+			sorted[n++] = (struct FeedEntry *)e->data;
+	}
+	qsort(sorted, n, sizeof(struct FeedEntry *), &_cmp_entries);
+
+	/* two feeds (e.g. one that redirects to the other) can share
+	 * entries, which have ended up next to each other */
+	size_t unique = 0;
+	*fresh = 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (unique > 0 && !strcmp(sorted[unique - 1]->url, sorted[i]->url)) {
+			if (sorted[i]->fresh && !sorted[unique - 1]->fresh)
+				sorted[unique - 1] = sorted[i], ++*fresh;
+			continue;
+		}
+		sorted[unique++] = sorted[i];
+		*fresh += sorted[i]->fresh;
+	}
+	n = unique;
+
+	char *buf = NULL, when[32];
+	size_t len = 0;
+	FILE *fp = open_memstream(&buf, &len);
+	ENSURE(fp);
+
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&refreshed));
+	fprintf(fp, "20 text/gemini\r\n# Feeds\n\n");
+	fprintf(fp, "%zu new entries from %zu feeds, as of %s.\n\n",
+		*fresh, nfeeds, when);
+
+	for (size_t i = 0; i < n && i < c_feeds_entries; ++i) {
+		struct FeedEntry *e = sorted[i];
+		fprintf(fp, "=> %s %s %s: %s%s\n", e->url, e->date,
+			*e->feed->title ? e->feed->title : e->feed->url,
+			*e->title ? e->title : e->url, e->fresh ? " (new)" : "");
+	}
+
+	if (failed > 0) {
+		fprintf(fp, "\n## Couldn't be fetched\n\n");
+		for (struct lnklist *l = feeds->next; l; l = l->next) {
+			struct Feed *fd = (struct Feed *)l->data;
+			if (fd->subscribed && *fd->error)
+				fprintf(fp, "=> %s %s: %s\n", fd->url,
+					*fd->title ? fd->title : fd->url, fd->error);
+		}
+	}
+
+	fclose(fp);
+	free(sorted);
+
+	CURLU *url = curl_url();
+	curl_url_set(url, CURLUPART_URL, "about://feeds/", 0);
+	struct Gemdoc *doc = gemdoc_new(url);
+	gemdoc_parse_buf(doc, buf, len);
+	free(buf);
+	return doc;
+}
+
+static void _fetch(struct Feed *fd, CURLU *url);
+
+static void
+_fetched(struct Fetch *f)
+{
+	struct Feed *fd = (struct Feed *)f->data;
+	--pending;
+
+	if (f->status != 0) {
+		strlcpy(fd->error, f->error, sizeof(fd->error));
+	} else if (f->doc->type == GEM_TYPE_REDIRECT) {
+		CURLU *url = curl_url_dup(f->doc->url);
+		if (fd->redirects < c_maximum_redirects
+				&& !curl_url_set(url, CURLUPART_URL, f->doc->meta, 0)) {
+			if (fd->body) fclose(fd->body);
+			fd->body = NULL, ++fd->redirects;
+			_fetch(fd, url);
+			return;
+		}
+		curl_url_cleanup(url);
+		strlcpy(fd->error, "too many (or invalid) redirects", sizeof(fd->error));
+	} else if (f->doc->type != GEM_TYPE_SUCCESS) {
+		snprintf(fd->error, sizeof(fd->error), "%zu %s",
+			f->doc->status, f->doc->meta);
+	} else {
+		_read(fd, f);
+	}
+
+	if (fd->body) fclose(fd->body);
+	fd->body = NULL;
+	if (*fd->error) ++failed;
+
+	if (pending > 0)
+		return;
+
+	fetch_limit(0, 0);
+	feeds_func_t callback = done;
+	size_t fresh;
+	struct Gemdoc *doc = _render(&fresh);
+	done = NULL;
+
+	if (callback)
+		(callback)(doc, fresh, failed);
+	else
+		gemdoc_free(doc);
+}
+
+static void
+_fetch(struct Feed *fd, CURLU *url)
+{
+	/* Atom feeds usually aren't text/ anything */
+	int flags = FETCH_NOCACHE;
+	flags |= (fd->body = tmpfile()) ? FETCH_SAVEFD : FETCH_NOSAVE;
+
+	struct Fetch *f = fetch_new(url, FETCH_PRIO_BACKGROUND, flags,
+		&_fetched, (void *)fd);
+	if (fd->body)
+		f->savefd = fileno(fd->body);
+	++pending;
+}
+
+/* where the subscriptions are, or NULL if there's nowhere for them. */
+char *
+feeds_path(void)
+{
+	static char *path = NULL;
+	if (path || c_feeds)
+		return c_feeds ? c_feeds : path;
+
+	char *base = getenv("XDG_CONFIG_HOME"), *home = getenv("HOME");
+	if (base && *base)
+		path = strdup(format("%s/mebsuta/feeds", base));
+	else if (home && *home)
+		path = strdup(format("%s/.config/mebsuta/feeds", home));
+	return path;
+}
+
+static void
+_subscribe(void)
+{
+	for (struct lnklist *l = feeds->next; l; l = l->next)
+		((struct Feed *)l->data)->subscribed = false;
+
+	FILE *fp = feeds_path() ? fopen(feeds_path(), "r") : NULL;
+	if (!fp) return;
+
+	char *line = NULL, *url = NULL;
+	size_t sz = 0;
+
+	while (getline(&line, &sz, fp) != -1) {
+		char *s = line, *end = line + strlen(line);
+		while (isspace(*s)) ++s;
+		while (end > s && isspace(end[-1])) *--end = '\0';
+		if (!*s || *s == '#')
+			continue;
+
+		CURLU *c_url = curl_url();
+		if (!curl_url_set(c_url, CURLUPART_URL,
+				strstr(s, "://") ? s : format("gemini://%s", s), 0)
+				&& !curl_url_get(c_url, CURLUPART_URL, &url, 0))
+			_feed(url)->subscribed = true;
+		curl_url_cleanup(c_url);
+		free(url);
+		url = NULL;
+	}
+
+	free(line);
+	fclose(fp);
+}
+
+/*
+ * Fetch every subscribed feed, and call done with what they have once
+ * they're all in. Returns how many there are to fetch (and done isn't
+ * called if there aren't any).
+ */
+size_t
+feeds_refresh(feeds_func_t callback)
+{
+	ENSURE(!pending);
+
+	if (!feeds) {
+		feeds = lnklist_new();
+		if ((log_fd = store_open_log("feeds")) != -1)
+			store_load_log(log_fd, &_parse_line);
+	}
+
+	_subscribe();
+	time(&refreshed);
+	failed = 0;
+
+	for (struct lnklist *l = feeds->next; l; l = l->next) {
+		struct Feed *fd = (struct Feed *)l->data;
+		for (struct lnklist *e = fd->entries->next; e; e = e->next)
+			((struct FeedEntry *)e->data)->fresh = false;
+		*fd->error = '\0', fd->redirects = 0;
+	}
+
+	/* most feeds are on a host of their own, so are fetched a lot
+	 * more at once than pages are */
+	fetch_limit(c_feeds_fetch_max, 0);
+
+	for (struct lnklist *l = feeds->next; l; l = l->next) {
+		struct Feed *fd = (struct Feed *)l->data;
+		CURLU *url = curl_url();
+		if (!fd->subscribed || curl_url_set(url, CURLUPART_URL, fd->url, 0))
+			curl_url_cleanup(url);
+		else
+			_fetch(fd, url);
+	}
+
+	if (pending == 0)
+		fetch_limit(0, 0);
+	else
+		done = callback;
+	return pending;
+}
+
+_Bool
+feeds_refreshing(void)
+{
+	return pending > 0;
+}
+
+void
+feeds_free(void)
+{
+	if (!feeds) return;
+
+	for (struct lnklist *l = feeds->next; l; l = l->next) {
+		struct Feed *fd = (struct Feed *)l->data;
+		for (struct lnklist *e = fd->entries->next; e; e = e->next) {
+			free(((struct FeedEntry *)e->data)->url);
+			free(e->data);
+		}
+		lnklist_free(fd->entries);
+		if (fd->body) fclose(fd->body);
+		free(fd->url);
+		free(fd);
+	}
+	lnklist_free(feeds);
+	feeds = NULL;
+
+	if (log_fd != -1) close(log_fd);
+	log_fd = -1;
+	pending = 0, done = NULL;
+}
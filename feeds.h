@@ -0,0 +1,17 @@
+#ifndef FEEDS_H
+#define FEEDS_H
+
+#include <sys/types.h>
+
+#include "gemini.h"
+
+/* called with the merged document (which it takes), how many entries are
+ * new, and how many feeds couldn't be fetched. */
+typedef void (*feeds_func_t)(struct Gemdoc *doc, size_t fresh, size_t failed);
+
+char   *feeds_path(void);
+size_t  feeds_refresh(feeds_func_t callback);
+_Bool   feeds_refreshing(void);
+void    feeds_free(void);
+
+#endif
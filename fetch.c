@@ -0,0 +1,1090 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "config.h"
+#include "conn.h"
+#include "curl/url.h"
+#include "dns.h"
+#include "fetch.h"
+#include "gemini.h"
+#include "list.h"
+#include "parser.h"
+#include "store.h"
+#include "strlcpy.h"
+#include "util.h"
+
+static struct lnklist *fetches = NULL;
+
+_Bool fetch_offline = false;
+
+/* hosts that told us to slow down (status 44), and until when. */
+struct Slowdown {
+	char *host;
+	struct timeval until;
+};
+
+static struct lnklist *slowdowns = NULL;
+
+/* overrides for c_fetch_max and c_fetch_host_max (see fetch_limit()) */
+static size_t limit_total = 0, limit_host = 0;
+
+static const char *state_names[] = {
+	[FETCH_QUEUED]    = "Waiting",
+	[FETCH_RESOLVE]   = "Resolving",
+	[FETCH_CONNECT]   = "Connecting",
+	[FETCH_HANDSHAKE] = "Handshaking",
+	[FETCH_READY]     = "Connected",
+	[FETCH_SEND]      = "Sending",
+	[FETCH_RECV]      = "Receiving",
+	[FETCH_PARSE]     = "Parsing",
+	[FETCH_DONE]      = "Done",
+	[FETCH_FAILED]    = "Failed",
+};
+
+static const char *timeouts[] = {
+	[FETCH_RESOLVE]   = "connection timed out",
+	[FETCH_CONNECT]   = "connection timed out",
+	[FETCH_HANDSHAKE] = "TLS handshake timed out",
+	[FETCH_READY]     = "connection went unused",
+	[FETCH_SEND]      = "server did not accept request",
+	[FETCH_RECV]      = "server stopped responding",
+	[FETCH_PARSE]     = "document took too long to parse",
+};
+
+/* move to a new state and give it `secs' seconds to finish. */
+static void
+_fetch_goto(struct Fetch *f, enum FetchState state, size_t secs)
+{
+	struct timeval now;
+	ENSURE(gettimeofday(&now, NULL) == 0);
+
+	if (f->state != state)
+		f->entered[state] = now;
+	f->state = state;
+	f->deadline = now;
+	f->deadline.tv_sec += secs;
+}
+
+static _Bool
+_fetch_fail(struct Fetch *f, ssize_t status, const char *error)
+{
+	/* a warmed-up connection may well have been closed by the server
+	 * while it sat idle, so try again with a fresh one */
+	if (f->reused && f->received == 0
+			&& (status == FETCH_ESEND || status == FETCH_ERECV)) {
+		struct Conn *c = conn_new(f->conn->host, f->conn->port);
+		conn_close(f->conn);
+		f->conn = c;
+
+		f->reused = false, f->sent = 0;
+		if (f->ctx) free(f->ctx), f->ctx = NULL;
+
+		_fetch_goto(f, FETCH_RESOLVE, c_connect_timeout);
+		return true;
+	}
+
+	_fetch_goto(f, FETCH_FAILED, 0);
+	f->status = status;
+	strlcpy(f->error, error, sizeof(f->error));
+	return false;
+}
+
+static struct Slowdown *
+_slowdown(char *host, struct timeval *now)
+{
+	if (!slowdowns)
+		slowdowns = lnklist_new();
+
+	struct Slowdown *found = NULL;
+	struct lnklist *l, *next;
+
+	for (l = slowdowns->next; l; l = next) {
+		next = l->next;
+		struct Slowdown *s = (struct Slowdown *)l->data;
+
+		if (timercmp(now, &s->until, >)) {
+			free(s->host), free(s);
+			lnklist_rm(l);
+		} else if (!strcmp(s->host, host)) {
+			found = s;
+		}
+	}
+
+	return found;
+}
+
+/* back off from host for as long as its 44 response's meta says. */
+static size_t
+_slow_down(char *host, char *meta)
+{
+	struct timeval now;
+	ENSURE(gettimeofday(&now, NULL) == 0);
+
+	struct Slowdown *s = _slowdown(host, &now);
+	if (!s) {
+		s = ecalloc(1, sizeof(struct Slowdown));
+		s->host = strdup(host);
+		lnklist_push(slowdowns, (void *)s);
+	}
+
+	size_t secs = strtol(meta, NULL, 10);
+	if (secs == 0) secs = c_slowdown_default;
+
+	s->until = now;
+	s->until.tv_sec += secs;
+	return secs;
+}
+
+static _Bool
+_fetch_parseline(struct Fetch *f, char *line)
+{
+	if (!gemdoc_parse(f->ctx, f->doc, line))
+		return _fetch_fail(f, FETCH_EPARSE, "Could not parse document.");
+	++f->lines;
+	return true;
+}
+
+/*
+ * Each of these handles a single state, and returns true if the state
+ * machine advanced and should be stepped again, or false if it's waiting
+ * on the socket (or has finished).
+ */
+
+static _Bool
+_fetch_queued(struct Fetch *f)
+{
+	/* _fetch_schedule() takes care of these */
+	UNUSED(f);
+	return false;
+}
+
+static _Bool
+_fetch_resolve(struct Fetch *f)
+{
+	switch (conn_resolve(f->conn)) {
+	break; case CONN_AGAIN:
+		return false;
+	break; case CONN_ERROR:
+		return _fetch_fail(f, FETCH_ECONN, f->conn->error);
+	}
+
+	_fetch_goto(f, FETCH_CONNECT, c_connect_timeout);
+	return true;
+}
+
+static _Bool
+_fetch_connect(struct Fetch *f)
+{
+	switch (conn_connect(f->conn)) {
+	break; case CONN_AGAIN:
+		return false;
+	break; case CONN_ERROR:
+		return _fetch_fail(f, FETCH_ECONN, f->conn->error);
+	}
+
+	_fetch_goto(f, FETCH_HANDSHAKE, c_handshake_timeout);
+	return true;
+}
+
+static _Bool
+_fetch_handshake(struct Fetch *f)
+{
+	switch (conn_handshake(f->conn)) {
+	break; case CONN_AGAIN:
+		return false;
+	break; case CONN_ERROR:
+		return _fetch_fail(f, FETCH_ECONN, f->conn->error);
+	}
+
+	if (f->speculative) {
+		_fetch_goto(f, FETCH_READY, c_preconnect_idle);
+		return false;
+	}
+
+	_fetch_goto(f, FETCH_SEND, c_read_timeout);
+	return true;
+}
+
+static _Bool
+_fetch_ready(struct Fetch *f)
+{
+	UNUSED(f);
+	return false;
+}
+
+static _Bool
+_fetch_send(struct Fetch *f)
+{
+	size_t len = strlen(f->request);
+
+	while (f->sent < len) {
+		ssize_t r = conn_send(f->conn, &f->request[f->sent], len - f->sent);
+		if (r == 0)
+			return false;
+		else if (r < 0)
+			return _fetch_fail(f, FETCH_ESEND, f->conn->error);
+		f->sent += r;
+	}
+
+	f->ctx = gemdoc_parse_init();
+	_fetch_goto(f, FETCH_RECV, c_read_timeout);
+	return true;
+}
+
+/* where to save f's response to; an existing file is never overwritten. */
+static int
+_fetch_savefile(struct Fetch *f)
+{
+	char *dir = c_download_dir, *home = getenv("HOME");
+	if (!dir) dir = getenv("XDG_DOWNLOAD_DIR");
+	if (!dir && home) dir = format("%s/Downloads", home);
+	if (!dir || access(dir, W_OK) == -1) dir = ".";
+	dir = strdup(dir);
+
+	char *path = NULL, *name = NULL;
+	curl_url_get(f->doc->url, CURLUPART_PATH, &path, 0);
+
+	if (path && strrchr(path, '/') && strrchr(path, '/')[1])
+		name = strrchr(path, '/') + 1;
+	else
+		name = "download";
+
+	int fd = -1;
+	for (size_t i = 0; fd == -1 && i < 100; ++i) {
+		free(f->saveto);
+		f->saveto = strdup(i ? format("%s/%s.%zu", dir, name, i)
+			: format("%s/%s", dir, name));
+		fd = open(f->saveto, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if (fd == -1 && errno != EEXIST)
+			break;
+	}
+
+	free(path);
+	free(dir);
+	return fd;
+}
+
+/*
+ * Called once the response line is in. Anything that isn't text gets
+ * saved to disk instead of parsed, so that its size doesn't matter.
+ */
+static _Bool
+_fetch_header(struct Fetch *f)
+{
+	f->header = true;
+
+	/* the rest of a gemtext document is parsed as it comes in, on
+	 * another thread; f->ctx is the parser's now */
+	if (c_parse_thread && !BITSET(f->flags, FETCH_NOTHREAD)
+			&& f->doc->type == GEM_TYPE_SUCCESS
+			&& f->doc->format == GEM_FORMAT_GEMTEXT) {
+		f->parser = parser_new(f->ctx, f->doc);
+		f->ctx = NULL;
+	}
+
+	if (f->doc->type != GEM_TYPE_SUCCESS
+			|| !strncmp(f->doc->mimetype, "text/", 5))
+		return true;
+
+	if (BITSET(f->flags, FETCH_NOSAVE))
+		return _fetch_fail(f, FETCH_ESAVE, format("Not saving %s file.",
+			f->doc->mimetype));
+
+	if (BITSET(f->flags, FETCH_SAVEFD)) {
+		f->saveto = strdup(format("fd %d", f->savefd));
+		return true;
+	}
+
+	if ((f->savefd = _fetch_savefile(f)) == -1) {
+		/* whatever's there isn't ours to clean up */
+		_fetch_fail(f, FETCH_ESAVE, format("Could not save to %s: %s",
+			f->saveto, strerror(errno)));
+		free(f->saveto);
+		f->saveto = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+static _Bool
+_fetch_save(struct Fetch *f, char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t w = write(f->savefd, data, len);
+		if (w == -1 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return _fetch_fail(f, FETCH_ESAVE, format("Could not save to %s: %s",
+				f->saveto, strerror(errno)));
+		data += w, len -= w;
+	}
+
+	return true;
+}
+
+/* keep a successful response, in memory and on disk. */
+static void
+_fetch_store(struct Fetch *f)
+{
+	char *key = cache_key(f->doc->url);
+	if (!key) return;
+
+	size_t len;
+	char *response = gemdoc_serialize(f->doc, &len);
+	store_put(key, response, len);
+	cache_put(key, response, len);
+	free(key);
+}
+
+/*
+ * Remember where a permanent redirect points, or, if the response wasn't
+ * one, forget about any redirect we thought there was.
+ */
+static void
+_fetch_note_redirect(struct Fetch *f)
+{
+	char *key = cache_key(f->doc->url), *target = NULL;
+	if (!key) return;
+
+	if (f->doc->status == GEM_STATUS_REDIRECT) {
+		CURLU *rurl = curl_url_dup(f->doc->url);
+		if (!curl_url_set(rurl, CURLUPART_URL, f->doc->meta, 0))
+			curl_url_get(rurl, CURLUPART_URL, &target, 0);
+		curl_url_cleanup(rurl);
+	}
+
+	cache_redirect(key, target);
+	store_redirect(key, target);
+
+	free(target);
+	free(key);
+}
+
+/* move whatever the parser's done into f's document. */
+static int
+_fetch_collect(struct Fetch *f)
+{
+	int r = parser_collect(f->parser, f->doc, &f->lines);
+	if (r == PARSER_FAILED)
+		_fetch_fail(f, FETCH_EPARSE, "Could not parse document.");
+	return r;
+}
+
+/*
+ * Whether enough of the response has been parsed for now, in which case
+ * the rest is left in the socket until it's wanted (see fetch_want()).
+ */
+static _Bool
+_fetch_sated(struct Fetch *f)
+{
+	if (!f->want || f->lines < f->want || f->saveto)
+		return false;
+
+	f->paused = true;
+	return true;
+}
+
+/* the whole response is in (and parsed); deal with it. */
+static _Bool
+_fetch_finish(struct Fetch *f)
+{
+	gemdoc_parse_finish(f->ctx, f->doc);
+	f->ctx = NULL;
+
+	if (f->saveto) {
+		if (!BITSET(f->flags, FETCH_SAVEFD))
+			close(f->savefd);
+		_fetch_goto(f, FETCH_DONE, 0);
+		return false;
+	}
+
+	if (f->doc->status == GEM_STATUS_SLOWDOWN
+			&& !BITSET(f->flags, FETCH_NOSLOWDOWN)) {
+		size_t secs = _slow_down(f->host, f->doc->meta);
+
+		/* wait our turn and try again, unless that'd take too long */
+		if (f->retries < c_slowdown_retries && secs <= c_slowdown_max_wait) {
+			CURLU *url = f->doc->url;
+			f->doc->url = NULL;
+			gemdoc_free(f->doc);
+			f->doc = gemdoc_new(url);
+
+			conn_close(f->conn);
+			f->conn = NULL;
+			f->reused = f->header = false;
+			f->sent = f->received = 0;
+			slabbuf_free(&f->buf);
+
+			++f->retries;
+			f->state = FETCH_QUEUED;
+			return false;
+		}
+	}
+
+	/* a response that's been paused is stored as well: we only get here
+	 * on a clean EOF, and a server that gave up on us while paused would
+	 * have cut the connection short (see _fetch_recv()) */
+	if (!BITSET(f->flags, FETCH_NOSTORE)) {
+		if (f->doc->type == GEM_TYPE_SUCCESS)
+			_fetch_store(f);
+		_fetch_note_redirect(f);
+	}
+
+	_fetch_goto(f, FETCH_DONE, 0);
+	return false;
+}
+
+/*
+ * Parse (or hand to the parser) every whole line that's in, or, if the
+ * response is being saved, save whatever's in.
+ */
+static _Bool
+_fetch_lines(struct Fetch *f)
+{
+	char *line;
+	size_t len;
+
+	while (!f->saveto && !(f->parser && parser_full(f->parser))
+			&& (line = slabbuf_line(&f->buf))) {
+		gemdoc_keep(f->doc, f->buf.slab);
+
+		if (f->parser) {
+			parser_feed(f->parser, line);
+			continue;
+		}
+
+		if (!_fetch_parseline(f, line))
+			return false;
+		if (!f->header && !_fetch_header(f))
+			return false;
+	}
+
+	if (f->saveto && (line = slabbuf_rest(&f->buf, &len)))
+		return _fetch_save(f, line, len);
+	return true;
+}
+
+static _Bool
+_fetch_recv(struct Fetch *f)
+{
+	ssize_t r = 0;
+	size_t len;
+	char *space;
+
+	if (f->parser && _fetch_collect(f) == PARSER_FAILED)
+		return false;
+
+	if (_fetch_sated(f))
+		return false;
+
+	/* the parser may have been behind last time */
+	if (!_fetch_lines(f))
+		return false;
+	if (f->parser && parser_full(f->parser))
+		return false;
+
+	if (f->paused) {
+		f->paused = false;
+		_fetch_goto(f, FETCH_RECV, c_read_timeout);
+	}
+
+	while ((space = slabbuf_space(&f->buf, &len))
+			&& (r = conn_recv(f->conn, space, len)) > 0) {
+		slabbuf_fill(&f->buf, r);
+		if (f->received == 0)
+			ENSURE(gettimeofday(&f->firstbyte, NULL) == 0);
+		f->received += r;
+		_fetch_goto(f, FETCH_RECV, c_read_timeout);
+
+		if (!_fetch_lines(f))
+			return false;
+
+		if (_fetch_sated(f))
+			return false;
+
+		/* stop reading until the parser's caught up */
+		if (f->parser && parser_full(f->parser))
+			return false;
+	}
+
+	if (r == 0)
+		return false;
+	else if (r == -2)
+		return _fetch_fail(f, FETCH_ERECV, f->conn->error);
+	else if (f->received == 0)
+		return _fetch_fail(f, FETCH_ERECV, "server closed the connection");
+
+	/* EOF; the last line might not have been terminated. There's room
+	 * for it in the parser, or we wouldn't have got this far. */
+	char *line = slabbuf_rest(&f->buf, &len);
+	if (!f->saveto && line && len > 0) {
+		gemdoc_keep(f->doc, f->buf.slab);
+
+		if (f->parser)
+			parser_feed(f->parser, line);
+		else if (!_fetch_parseline(f, line))
+			return false;
+
+		if (!f->header && !_fetch_header(f))
+			return false;
+	}
+
+	if (f->parser) {
+		_fetch_goto(f, FETCH_PARSE, c_read_timeout);
+		return true;
+	}
+
+	return _fetch_finish(f);
+}
+
+/* wait for the parser to get through the rest of the response. */
+static _Bool
+_fetch_parse(struct Fetch *f)
+{
+	if (!f->fed)
+		f->fed = parser_finish(f->parser);
+
+	switch (_fetch_collect(f)) {
+	break; case PARSER_FAILED: case PARSER_RUNNING:
+		return false;
+	}
+
+	f->ctx = parser_free(f->parser);
+	f->parser = NULL;
+	return _fetch_finish(f);
+}
+
+static _Bool (*const steps[])(struct Fetch *) = {
+	[FETCH_QUEUED]    = &_fetch_queued,
+	[FETCH_RESOLVE]   = &_fetch_resolve,
+	[FETCH_CONNECT]   = &_fetch_connect,
+	[FETCH_HANDSHAKE] = &_fetch_handshake,
+	[FETCH_READY]     = &_fetch_ready,
+	[FETCH_SEND]      = &_fetch_send,
+	[FETCH_RECV]      = &_fetch_recv,
+	[FETCH_PARSE]     = &_fetch_parse,
+};
+
+static void
+_fetch_free(struct Fetch *f)
+{
+	conn_close(f->conn);
+	if (f->parser)  f->ctx = parser_free(f->parser);
+	if (f->ctx)     free(f->ctx);
+	if (f->doc)     gemdoc_free(f->doc);
+	if (f->request) free(f->request);
+	slabbuf_free(&f->buf);
+
+	/* don't leave half a file lying around */
+	if (f->saveto && f->state != FETCH_DONE
+			&& !BITSET(f->flags, FETCH_SAVEFD)) {
+		if (f->savefd != -1) close(f->savefd);
+		unlink(f->saveto);
+	}
+	free(f->saveto);
+
+	free(f->host);
+	free(f->port);
+	free(f);
+}
+
+/*
+ * Look for a speculative connection to host:port (finished or not) for f
+ * to take over.
+ */
+static _Bool
+_fetch_adopt(struct Fetch *f, char *host, char *port)
+{
+	for (struct lnklist *l = fetches->next; l; l = l->next) {
+		struct Fetch *s = (struct Fetch *)l->data;
+
+		if (!s->speculative || s->state >= FETCH_DONE)
+			continue;
+		if (strcmp(s->conn->host, host) || strcmp(s->conn->port, port))
+			continue;
+
+		f->conn = s->conn, s->conn = NULL;
+		if (s->state == FETCH_READY) {
+			f->reused = true;
+			_fetch_goto(f, FETCH_SEND, c_read_timeout);
+		} else {
+			f->state = s->state;
+			f->deadline = s->deadline;
+		}
+
+		lnklist_rm(l);
+		_fetch_free(s);
+		return true;
+	}
+
+	return false;
+}
+
+/* actually get a queued fetch going. */
+static void
+_fetch_start(struct Fetch *f)
+{
+	if (_fetch_adopt(f, f->host, f->port))
+		return;
+
+	f->conn = conn_new(f->host, f->port);
+
+	if (f->conn->error[0])
+		_fetch_fail(f, FETCH_ECONN, f->conn->error);
+	else
+		_fetch_goto(f, FETCH_RESOLVE, c_connect_timeout);
+}
+
+/*
+ * Start as many queued fetches as the limits allow, most important first.
+ * Fetches to hosts that asked us to slow down are left queued until the
+ * host's had time to cool off.
+ */
+static void
+_fetch_schedule(struct timeval *now)
+{
+	struct lnklist *l, *m;
+
+	for (enum FetchPriority p = 0; p <= FETCH_PRIO_PREFETCH; ++p) {
+		for (l = fetches->next; l; l = l->next) {
+			struct Fetch *f = (struct Fetch *)l->data;
+			if (f->state != FETCH_QUEUED || f->priority != p)
+				continue;
+			if (!BITSET(f->flags, FETCH_NOSLOWDOWN)
+					&& _slowdown(f->host, now))
+				continue;
+
+			/* only count those that f can't jump ahead of */
+			size_t total = 0, host = 0;
+			for (m = fetches->next; m; m = m->next) {
+				struct Fetch *o = (struct Fetch *)m->data;
+				if (o->speculative || o->priority > p || o->paused
+						|| o->state == FETCH_QUEUED
+						|| o->state >= FETCH_DONE)
+					continue;
+				++total;
+				if (!strcmp(o->host, f->host) && !strcmp(o->port, f->port))
+					++host;
+			}
+
+			if (total < (limit_total ? limit_total : c_fetch_max)
+					&& host < (limit_host ? limit_host : c_fetch_host_max))
+				_fetch_start(f);
+		}
+	}
+}
+
+/*
+ * Start fetching url (which the fetch takes ownership of). Nothing is done
+ * until the next call to fetch_poll(), and `done' (which may be NULL) is
+ * never called from here, even if the request fails immediately.
+ */
+struct Fetch *
+fetch_new(CURLU *url, enum FetchPriority priority, int flags,
+		fetch_func_t done, void *data)
+{
+	ENSURE(url);
+
+	if (!fetches)
+		fetches = lnklist_new();
+
+	struct Fetch *f = ecalloc(1, sizeof(struct Fetch));
+	f->doc = gemdoc_new(url);
+	f->priority = priority;
+	f->flags = flags;
+	f->done = done;
+	f->data = data;
+
+	char *scheme = NULL, *host = NULL, *port = NULL, *clurl = NULL;
+
+	/* skip straight to the end of any permanent redirects we know of */
+	for (size_t i = 0; !BITSET(flags, FETCH_NOCACHE)
+			&& i < c_maximum_redirects; ++i) {
+		char *key = cache_key(url), *target = NULL;
+		if (key && !(target = cache_redirected(key))
+				&& (target = store_redirected(key)))
+			cache_redirect(key, target);
+		free(key);
+
+		if (!target || curl_url_set(url, CURLUPART_URL, target, 0))
+			break;
+	}
+
+	/* wait, did you say gopher? */
+	if (curl_url_get(url, CURLUPART_SCHEME, &scheme, 0)
+			|| strcmp(scheme, "gemini")) {
+		_fetch_fail(f, FETCH_ESCHEME, format("Unsupported URL scheme '%s'",
+				scheme ? scheme : ""));
+		goto cleanup;
+	}
+
+	curl_url_get(url, CURLUPART_HOST, &host, 0);
+	curl_url_get(url, CURLUPART_PORT, &port, 0);
+	curl_url_get(url, CURLUPART_URL, &clurl, 0);
+
+	f->request = strdup(format("%s\r\n", clurl));
+
+	/* serve it from the cache if we can. Stale responses are only any
+	 * use if they'll be revalidated (see c_cache_swr), or if we're
+	 * offline and they're all we've got. */
+	char *key = cache_key(url), *response;
+	size_t len;
+	time_t stored;
+	_Bool stale = false;
+
+	if (key && !BITSET(flags, FETCH_NOCACHE)) {
+		_Bool *stalep = c_cache_swr || fetch_offline ? &stale : NULL;
+
+		if (cache_get(key, &response, &len, stalep)) {
+			f->cached = true;
+			if (!gemdoc_parse_buf(f->doc, response, len))
+				_fetch_fail(f, FETCH_EPARSE, "Could not parse document.");
+		} else if (store_get(key, &response, &len, &stored)) {
+			/* gemdoc_parse_buf() copies the response out of the
+			 * mapping, so it can be let go of straight away */
+			stale = time(NULL) - stored >= (time_t)c_cache_ttl;
+			if (!stale || stalep) {
+				f->cached = true;
+				if (!gemdoc_parse_buf(f->doc, response, len))
+					_fetch_fail(f, FETCH_EPARSE, "Could not parse document.");
+			}
+			store_release(response, len);
+		}
+	}
+
+	free(key);
+
+	if (f->cached) {
+		f->received = len;
+		f->stale = stale && !fetch_offline;
+		if (f->state != FETCH_FAILED)
+			f->state = FETCH_DONE;
+		goto cleanup;
+	} else if (fetch_offline) {
+		_fetch_fail(f, FETCH_EOFFLINE, "Not in the cache, and we're offline.");
+		goto cleanup;
+	}
+
+	/* wait for _fetch_schedule() to get round to it */
+	f->host = strdup(host);
+	f->port = strdup(port ? port : "1965");
+	f->state = FETCH_QUEUED;
+	ENSURE(gettimeofday(&f->entered[FETCH_QUEUED], NULL) == 0);
+
+cleanup:
+	free(scheme);
+	free(host);
+	free(port);
+	free(clurl);
+
+	lnklist_push(fetches, (void *)f);
+	return f;
+}
+
+/*
+ * Warm up a connection (DNS, TCP and TLS) to url's host, in the hope that
+ * it's about to be fetched. It's dropped if nothing uses it within
+ * c_preconnect_idle seconds.
+ */
+void
+fetch_preconnect(CURLU *url)
+{
+	ENSURE(url);
+
+	if (!c_preconnect || fetch_offline)
+		return;
+
+	if (!fetches)
+		fetches = lnklist_new();
+
+	char *scheme = NULL, *host = NULL, *port = NULL;
+	size_t speculative = 0;
+
+	if (curl_url_get(url, CURLUPART_SCHEME, &scheme, 0)
+			|| strcmp(scheme, "gemini"))
+		goto cleanup;
+	if (curl_url_get(url, CURLUPART_HOST, &host, 0))
+		goto cleanup;
+	curl_url_get(url, CURLUPART_PORT, &port, 0);
+
+	for (struct lnklist *l = fetches->next; l; l = l->next) {
+		struct Fetch *s = (struct Fetch *)l->data;
+		if (!s->speculative || s->state >= FETCH_DONE)
+			continue;
+		if (!strcmp(s->conn->host, host)
+				&& !strcmp(s->conn->port, port ? port : "1965"))
+			goto cleanup; /* already on it */
+		++speculative;
+	}
+
+	if (speculative >= c_preconnect_max)
+		goto cleanup;
+
+	struct Fetch *f = ecalloc(1, sizeof(struct Fetch));
+	f->speculative = true;
+	f->conn = conn_new(host, port ? port : "1965");
+
+	if (f->conn->error[0])
+		_fetch_fail(f, FETCH_ECONN, f->conn->error);
+	else
+		_fetch_goto(f, FETCH_RESOLVE, c_connect_timeout);
+
+	lnklist_push(fetches, (void *)f);
+
+cleanup:
+	free(scheme);
+	free(host);
+	free(port);
+}
+
+/* how fast (in bytes a second) the response has been coming in. */
+size_t
+fetch_rate(struct Fetch *f)
+{
+	if (f->state != FETCH_RECV)
+		return 0;
+
+	struct timeval now, elapsed;
+	ENSURE(gettimeofday(&now, NULL) == 0);
+	timersub(&now, &f->entered[FETCH_RECV], &elapsed);
+
+	size_t ms = elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000;
+	return ms ? f->received * 1000 / ms : 0;
+}
+
+/* only read and parse the first `lines' lines of the response, for now. */
+void
+fetch_want(struct Fetch *f, size_t lines)
+{
+	ENSURE(f);
+	f->want = lines;
+}
+
+/*
+ * Take what's been parsed of a paused fetch's response, say because the
+ * reader's moving on from a page they only read the top of. The fetch
+ * should be cancelled afterwards.
+ */
+struct Gemdoc *
+fetch_take(struct Fetch *f)
+{
+	ENSURE(f);
+
+	if (!f->paused)
+		return NULL;
+
+	if (f->parser) {
+		parser_collect(f->parser, f->doc, &f->lines);
+		f->ctx = parser_free(f->parser);
+		f->parser = NULL;
+	}
+
+	if (!f->ctx)
+		return NULL;
+
+	gemdoc_parse_finish(f->ctx, f->doc);
+	f->ctx = NULL;
+
+	struct Gemdoc *g = f->doc;
+	f->doc = NULL;
+	return g;
+}
+
+/* change a fetch's priority; this only matters if it's still queued. */
+void
+fetch_prioritize(struct Fetch *f, enum FetchPriority priority)
+{
+	ENSURE(f);
+	f->priority = priority;
+}
+
+/*
+ * Change how many fetches can be in flight at once, in total and to any
+ * one host; 0 goes back to c_fetch_max (or c_fetch_host_max).
+ */
+void
+fetch_limit(size_t total, size_t host)
+{
+	limit_total = total, limit_host = host;
+}
+
+/* whether url's host has asked us to slow down, and it's not been long enough. */
+_Bool
+fetch_slowed_down(CURLU *url)
+{
+	char *host = NULL;
+	if (curl_url_get(url, CURLUPART_HOST, &host, 0))
+		return false;
+
+	struct timeval now;
+	ENSURE(gettimeofday(&now, NULL) == 0);
+
+	_Bool slow = _slowdown(host, &now) != NULL;
+	free(host);
+	return slow;
+}
+
+const char *
+fetch_state_name(enum FetchState state)
+{
+	return state_names[state];
+}
+
+/* abort a fetch without calling its callback. */
+void
+fetch_cancel(struct Fetch *f)
+{
+	ENSURE(f), ENSURE(fetches);
+
+	for (struct lnklist *l = fetches->next; l; l = l->next) {
+		if (l->data != (void *)f)
+			continue;
+		lnklist_rm(l);
+		_fetch_free(f);
+		return;
+	}
+}
+
+size_t
+fetch_active(void)
+{
+	if (!fetches) return 0;
+	ssize_t l = lnklist_len(fetches);
+	return l >= 0 ? (size_t)l : 0;
+}
+
+/*
+ * Wait up to `timeout' milliseconds for any fetch's socket to become ready,
+ * then advance every fetch as far as it'll go without blocking. Finished
+ * fetches have their callbacks called and are freed.
+ *
+ * Returns the number of fetches that made some progress.
+ */
+size_t
+fetch_poll(int timeout)
+{
+	return fetch_poll_fds(NULL, 0, timeout);
+}
+
+/*
+ * fetch_poll(), but also wait on the caller's `fds' (whose revents are
+ * filled in), so that it can serve its own sockets in the same loop.
+ */
+size_t
+fetch_poll_fds(struct pollfd *fds, nfds_t nfds_extra, int timeout)
+{
+	size_t len = fetch_active();
+	if (len == 0 && nfds_extra == 0) return 0;
+	if (!fetches) fetches = lnklist_new();
+
+	struct timeval now;
+	ENSURE(gettimeofday(&now, NULL) == 0);
+	_fetch_schedule(&now);
+
+	/* a few for each fetch (and its parser), one for the resolver, and
+	 * the caller's */
+	struct pollfd pfds[len * (CONN_MAXRACE + 1) + 1 + nfds_extra];
+	nfds_t nfds = 0;
+	struct lnklist *l, *next;
+
+	if (dns_fd() != -1) {
+		pfds[nfds].fd = dns_fd();
+		pfds[nfds].events = POLLIN;
+		pfds[nfds].revents = 0;
+		++nfds;
+	}
+
+	for (l = fetches->next; l; l = l->next) {
+		struct Fetch *f = (struct Fetch *)l->data;
+		if (f->parser) {
+			pfds[nfds].fd = parser_fd(f->parser);
+			pfds[nfds].events = POLLIN;
+			pfds[nfds].revents = 0;
+			++nfds;
+		}
+
+		if (f->state == FETCH_QUEUED) {
+			/* waiting for its turn */
+		} else if (f->paused && f->want && f->lines >= f->want) {
+			/* has all it wants for now */
+		} else if (f->paused) {
+			/* wants more, and libtls might already have it */
+			timeout = 0;
+		} else if (f->state == FETCH_RESOLVE && !f->conn->query) {
+			/* hasn't started its lookup yet */
+			timeout = 0;
+		} else if (f->state == FETCH_PARSE || (f->parser && parser_full(f->parser))) {
+			/* waiting on the parser */
+		} else if (f->state == FETCH_RESOLVE || f->state == FETCH_READY) {
+			/* waiting on the resolver, or for someone to
+			 * take over the connection */
+		} else if (f->state < FETCH_DONE && conn_pollfds(f->conn, &pfds[nfds])) {
+			nfds += conn_pollfds(f->conn, &pfds[nfds]);
+			timeout = conn_timeout(f->conn, timeout);
+		} else if (f->state < FETCH_DONE && f->conn->replay) {
+			/* nothing to poll; the trace says when to come back */
+			timeout = conn_timeout(f->conn, timeout);
+		} else {
+			/* this one can be stepped right away */
+			timeout = 0;
+		}
+	}
+
+	for (nfds_t i = 0; i < nfds_extra; ++i)
+		pfds[nfds + i] = fds[i];
+
+	if (poll(pfds, nfds + nfds_extra, timeout) == -1 && errno != EINTR)
+		die("poll:");
+
+	for (nfds_t i = 0; i < nfds_extra; ++i)
+		fds[i].revents = pfds[nfds + i].revents;
+
+	dns_poll();
+	ENSURE(gettimeofday(&now, NULL) == 0);
+
+	size_t progress = 0;
+	struct lnklist *finished = lnklist_new();
+
+	for (l = fetches->next; l; l = next) {
+		next = l->next;
+
+		struct Fetch *f = (struct Fetch *)l->data;
+		enum FetchState state = f->state;
+		size_t received = f->received;
+
+		while (f->state < FETCH_DONE && (steps[f->state])(f));
+
+		if (f->state > FETCH_QUEUED && f->state < FETCH_DONE && !f->paused
+				&& timercmp(&now, &f->deadline, >))
+			_fetch_fail(f, FETCH_ETIMEOUT, timeouts[f->state]);
+
+		/* detach finished fetches first, as their callbacks
+		 * may well start new ones */
+		if (f->state >= FETCH_DONE) {
+			lnklist_push(finished, (void *)f);
+			lnklist_rm(l);
+			++progress;
+		} else if (f->state != state || f->received != received) {
+			++progress;
+		}
+	}
+
+	for (l = finished->next; l; l = l->next) {
+		struct Fetch *f = (struct Fetch *)l->data;
+		if (f->done)
+			(f->done)(f);
+		_fetch_free(f);
+	}
+
+	lnklist_free(finished);
+	return progress;
+}
@@ -0,0 +1,138 @@
+#ifndef FETCH_H
+#define FETCH_H
+
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "conn.h"
+#include "curl/url.h"
+#include "gemini.h"
+#include "parser.h"
+#include "slab.h"
+
+#define FETCH_ESCHEME   -1
+#define FETCH_ECONN     -2
+#define FETCH_ESEND     -3
+#define FETCH_ERECV     -4
+#define FETCH_EPARSE    -5
+#define FETCH_ETIMEOUT  -6
+#define FETCH_EOFFLINE  -7
+#define FETCH_ESAVE     -8
+
+/* flags for fetch_new() */
+#define FETCH_NOCACHE   (1<<1) /* don't use a cached response */
+#define FETCH_NOSAVE    (1<<2) /* fail rather than save a non-text response */
+#define FETCH_NOTHREAD  (1<<3) /* parse on this thread (see c_parse_thread) */
+#define FETCH_NOSLOWDOWN (1<<4) /* don't back off (or retry) after a 44 */
+#define FETCH_NOSTORE   (1<<5) /* don't cache the response, or note redirects */
+#define FETCH_SAVEFD    (1<<6) /* save non-text responses to (the caller's) `savefd' */
+
+enum FetchState {
+	FETCH_QUEUED,
+	FETCH_RESOLVE,
+	FETCH_CONNECT,
+	FETCH_HANDSHAKE,
+	FETCH_READY,
+	FETCH_SEND,
+	FETCH_RECV,
+	FETCH_PARSE, /* everything's in; waiting on the parser */
+	FETCH_DONE,
+	FETCH_FAILED,
+};
+
+/*
+ * Which fetches go first when there are more than c_fetch_max in flight
+ * (or c_fetch_host_max to a single host). Fetches are only ever held back
+ * by ones of the same or a higher priority.
+ */
+enum FetchPriority {
+	FETCH_PRIO_FOREGROUND, /* a page being loaded in the current tab */
+	FETCH_PRIO_VISIBLE,    /* refreshing what's on the screen */
+	FETCH_PRIO_BACKGROUND, /* a page being loaded in another tab */
+	FETCH_PRIO_PREFETCH,
+};
+
+struct Fetch;
+typedef void (*fetch_func_t)(struct Fetch *f);
+
+/*
+ * A single in-flight request. Fetches are driven by fetch_poll() from the
+ * main loop; once one has finished (successfully or not), its `done'
+ * callback is called, after which the fetch is freed. The callback may
+ * take ownership of `doc' by setting it to NULL.
+ */
+struct Fetch {
+	enum FetchState state;
+	ssize_t status;
+	char error[256];
+
+	struct Gemdoc *doc;
+	gemdoc_ctx_t *ctx;
+	struct Conn *conn;
+
+	enum FetchPriority priority;
+	int flags;
+	char *host, *port;
+	size_t retries; /* after being told to slow down */
+
+	/* non-text responses are written straight to `saveto' as they
+	 * come in, rather than being parsed (or, with FETCH_SAVEFD, to
+	 * whatever `savefd' was set to after fetch_new()) */
+	_Bool header;
+	char *saveto;
+	int savefd;
+
+	/* speculative fetches only connect, and then wait (in FETCH_READY)
+	 * for a real fetch to the same host to take over the connection */
+	_Bool speculative, reused;
+
+	/* set if the response came from the cache, and if that response
+	 * is due to be fetched again */
+	_Bool cached, stale;
+
+	/* gemtext is parsed on another thread (see c_parse_thread); `fed'
+	 * is set once the parser has been given the whole body */
+	struct Parser *parser;
+	_Bool fed;
+
+	char *request;
+	size_t sent;
+
+	struct Slabbuf buf; /* what's in, but not yet parsed (or saved) */
+	size_t received;    /* total bytes received */
+
+	/* lines parsed so far, and how many are wanted (0 for all of
+	 * them); reading stops while there are enough */
+	size_t lines, want;
+	_Bool paused;
+
+	/* when each state was (last) entered, and when the first of the
+	 * response came in */
+	struct timeval entered[FETCH_FAILED + 1];
+	struct timeval firstbyte;
+	struct timeval deadline;
+
+	fetch_func_t done;
+	void *data;
+};
+
+/* if set, requests are only ever served from the cache */
+extern _Bool fetch_offline;
+
+struct Fetch *fetch_new(CURLU *url, enum FetchPriority priority, int flags,
+		fetch_func_t done, void *data);
+void fetch_preconnect(CURLU *url);
+void fetch_prioritize(struct Fetch *f, enum FetchPriority priority);
+void fetch_limit(size_t total, size_t host);
+void fetch_want(struct Fetch *f, size_t lines);
+struct Gemdoc *fetch_take(struct Fetch *f);
+_Bool fetch_slowed_down(CURLU *url);
+const char *fetch_state_name(enum FetchState state);
+size_t fetch_rate(struct Fetch *f);
+void fetch_cancel(struct Fetch *f);
+size_t fetch_active(void);
+size_t fetch_poll(int timeout);
+size_t fetch_poll_fds(struct pollfd *fds, nfds_t nfds, int timeout);
+
+#endif
@@ -11,14 +11,18 @@
 #include "conn.h"
 #include "gemini.h"
 #include "list.h"
+#include "slab.h"
 #include "strlcpy.h"
 #include "util.h"
 
+struct Gemhandler;
+
 /* parser state */
 struct Gemdoc_CTX {
 	_Bool preformat_on;
 	char  preformat_alt[128];
 	size_t line, links;
+	const struct Gemhandler *handler;
 };
 
 static _Bool
@@ -50,8 +54,9 @@ _parse_metatext(struct Gemdoc *g)
 	if (g->type != GEM_TYPE_SUCCESS || strlen(meta) == 0)
 		return true;
 
-	char *end = eat(meta, isgraph, SIZEOF(g->mimetype));
-	strlcpy(g->mimetype, meta, end - meta + 1);
+	/* drop any parameters (e.g. "; charset=utf-8") */
+	size_t len = strcspn(meta, "; \t");
+	strlcpy(g->mimetype, meta, MAX(len + 1, sizeof(g->mimetype)));
 
 	return true;
 }
@@ -140,6 +145,8 @@ gemdoc_new(CURLU *url)
 	g->url = url;
 	g->document = lnklist_new();
 	g->rawdoc = lnklist_new();
+	g->doctail = g->document, g->rawtail = g->rawdoc;
+	g->slabs = lnklist_new();
 
 	bzero(g->meta, sizeof(g->meta));
 	g->encoding = GEM_CHARSET_UTF8;
@@ -164,29 +171,36 @@ gemdoc_parse_init(void)
 	return c;
 }
 
-_Bool
-gemdoc_parse(struct Gemdoc_CTX *ctx, struct Gemdoc *g, char *line)
+/* put node straight after *tail (the last node of one of a document's
+ * lists), rather than walking the list to find its end. */
+static void
+_link(struct lnklist **tail, struct lnklist *node)
+{
+	node->prev = *tail;
+	node->next = NULL;
+	(*tail)->next = node;
+	*tail = node;
+}
+
+/* like lnklist_push(), but with the node allocated out of g's arena. */
+static void
+_push(struct Gemdoc *g, struct lnklist **tail, void *data)
+{
+	struct lnklist *node = arena_alloc(&g->arena, sizeof(struct lnklist));
+	node->data = data;
+	_link(tail, node);
+}
+
+static _Bool
+_parse_gemtext(struct Gemdoc_CTX *ctx, struct Gemdoc *g, char *line)
 {
 	/* store a pointer to the beginning of the line, just in case we
 	 * need to back up and restore the line after moving the ptr forward */
 	char *begin = line;
 
-	/* remove trailing \r, if any */
-	char *cr = NULL;
-	if ((cr = memchr((void *)line, '\r', strlen(line))))
-		*cr = '\0';
-
-	++ctx->line;
-	lnklist_push(g->rawdoc, strdup(line));
-
-	if (ctx->line == 1) {
-		/* We're on the first line. Parse the status code and
-		 * the meta text and bail out. */
-		return _parse_responseline(g, line);
-	} else if (ctx->line == 2 && strlen(line) == 0) {
-		/* ignore blank line after response code */
+	/* ignore blank line after response code */
+	if (ctx->line == 2 && strlen(line) == 0)
 		return true;
-	}
 
 	if (!strncmp(line, "```", 3)) {
 		ctx->preformat_on = !ctx->preformat_on;
@@ -197,7 +211,7 @@ gemdoc_parse(struct Gemdoc_CTX *ctx, struct Gemdoc *g, char *line)
 	}
 
 	size_t type = _line_type(ctx, &line);
-	struct Gemtok *gdl = ecalloc(1, sizeof(struct Gemtok));
+	struct Gemtok *gdl = arena_alloc(&g->arena, sizeof(struct Gemtok));
 
 	if (type == GEM_DATA_LINK) {
 		gdl->type = type;
@@ -209,14 +223,15 @@ gemdoc_parse(struct Gemdoc_CTX *ctx, struct Gemdoc *g, char *line)
 
 		/* 2) Find the end of the URL, and copy it */
 		for (end = line; *end && !isblank(*end); ++end);
-		gdl->raw_link_url = strndup(line, end - line);
+		gdl->raw_link_url = arena_alloc(&g->arena, end - line + 1);
+		memcpy(gdl->raw_link_url, line, end - line);
 
 		if (*end) {
 			/* 3) Remove spaces after the end of the URL */
 			for (line = ++end; *line && isblank(*line); ++line);
 
 			/* 4) Grab the URL's alt text */
-			gdl->text = strdup(end);
+			gdl->text = end;
 		}
 
 		CURLUcode c_rc;
@@ -236,26 +251,87 @@ gemdoc_parse(struct Gemdoc_CTX *ctx, struct Gemdoc *g, char *line)
 			break; /* yey */
 		case CURLUE_MALFORMED_INPUT:
 		default:
-			free(gdl->text);
-			free(gdl->raw_link_url);
 			curl_url_cleanup(gdl->link_url);
 
 			gdl->type = GEM_DATA_TEXT;
-			gdl->text = strdup(begin);
+			gdl->text = begin;
 			gdl->link_url = NULL, gdl->raw_link_url = NULL;
-			lnklist_push(g->document, (void *) gdl);
+			_push(g, &g->doctail, (void *) gdl);
 			return true;
 		}
 
-		lnklist_push(g->document, (void *) gdl);
+		_push(g, &g->doctail, (void *) gdl);
 	} else {
 		if (type != GEM_DATA_PREFORMAT && type != GEM_DATA_TEXT)
 			while (*line && isblank(*line)) ++line;
 		gdl->type = type;
-		gdl->text = strdup(line);
-		lnklist_push(g->document, (void *)gdl);
+		gdl->text = line;
+		_push(g, &g->doctail, (void *)gdl);
+	}
+
+	return true;
+}
+
+/* plain text is shown as is, so there's nothing to do beyond keeping the
+ * line (which gemdoc_parse() has already done). */
+static _Bool
+_parse_plain(struct Gemdoc_CTX *ctx, struct Gemdoc *g, char *line)
+{
+	UNUSED(ctx), UNUSED(g), UNUSED(line);
+	return true;
+}
+
+/*
+ * How to handle the body of a response, by mimetype (the first whose
+ * mimetype prefixes the response's is used). Anything that isn't text
+ * never gets this far; see _fetch_header().
+ */
+static const struct Gemhandler {
+	char *mimetype;
+	size_t format;
+	_Bool (*parse)(struct Gemdoc_CTX *ctx, struct Gemdoc *g, char *line);
+} handlers[] = {
+	{ "text/gemini", GEM_FORMAT_GEMTEXT, &_parse_gemtext },
+	{ "",            GEM_FORMAT_PLAIN,   &_parse_plain   },
+};
+
+/*
+ * Parse a line of a response. The line isn't copied: it (and the text of
+ * its token) is kept as is, so it must live as long as g does; see
+ * gemdoc_keep(). The token and list nodes come out of g's arena.
+ */
+_Bool
+gemdoc_parse(struct Gemdoc_CTX *ctx, struct Gemdoc *g, char *line)
+{
+	/* remove trailing \r, if any */
+	char *cr = NULL;
+	if ((cr = memchr((void *)line, '\r', strlen(line))))
+		*cr = '\0';
+
+	++ctx->line;
+	_push(g, &g->rawtail, line);
+
+	if (ctx->line > 1)
+		return ctx->handler && (ctx->handler->parse)(ctx, g, line);
+
+	/* We're on the first line. Parse the status code and the meta
+	 * text, and decide what to do with the rest. */
+	if (!_parse_responseline(g, line))
+		return false;
+	_parse_metatext(g);
+
+	ctx->handler = &handlers[0];
+	if (g->type == GEM_TYPE_SUCCESS) {
+		for (size_t i = 0; i < SIZEOF(handlers); ++i) {
+			if (!strncmp(g->mimetype, handlers[i].mimetype,
+					strlen(handlers[i].mimetype))) {
+				ctx->handler = &handlers[i];
+				break;
+			}
+		}
 	}
 
+	g->format = ctx->handler->format;
 	return true;
 }
 
@@ -266,14 +342,90 @@ gemdoc_parse_finish(struct Gemdoc_CTX *ctx, struct Gemdoc *g)
 	free(ctx);
 
 	_set_title(g);
-	_parse_metatext(g);
 
 	return true;
 }
 
+/* add a line's nodes (and its token's, if it has one) to the end of g. */
+void
+gemdoc_link(struct Gemdoc *g, struct lnklist *raw, struct lnklist *tok)
+{
+	_link(&g->rawtail, raw);
+	if (tok) _link(&g->doctail, tok);
+}
+
+/* g's lines (or some of them) are in s; hold on to it for as long as g. */
+void
+gemdoc_keep(struct Gemdoc *g, struct Slab *s)
+{
+	/* slabs are kept newest first, so this is usually the first one */
+	if (g->slabs->next && g->slabs->next->data == (void *)s)
+		return;
+	lnklist_insert(g->slabs, (void *)slab_ref(s));
+}
+
+/* parse an entire response (response line and all) in one go. */
+_Bool
+gemdoc_parse_buf(struct Gemdoc *g, char *buf, size_t len)
+{
+	ENSURE(g), ENSURE(buf);
+
+	/* buf might be a read-only mapping (and won't be around for as
+	 * long as g anyway), so the lot's copied into a slab of its own */
+	struct Slab *s = slab_new(len + 1);
+	memcpy(s->data, buf, len);
+	s->data[len] = '\0';
+	gemdoc_keep(g, s);
+	slab_unref(s);
+
+	struct Gemdoc_CTX *ctx = gemdoc_parse_init();
+	char *p = s->data, *bufend = s->data + len, *end;
+	_Bool ok = true;
+
+	for (; ok && p < bufend; p = end + 1) {
+		if ((end = memchr(p, '\n', bufend - p)))
+			*end = '\0';
+		else
+			end = bufend;
+
+		ok = gemdoc_parse(ctx, g, p);
+	}
+
+	gemdoc_parse_finish(ctx, g);
+	return ok;
+}
+
+/*
+ * Reassemble a response from the raw lines that were parsed; the result
+ * can be fed back to gemdoc_parse_buf().
+ */
+char *
+gemdoc_serialize(struct Gemdoc *g, size_t *len)
+{
+	ENSURE(g);
+
+	struct lnklist *c;
+	size_t sz = 0;
+
+	for (c = g->rawdoc->next; c; c = c->next)
+		sz += strlen((char *)c->data) + 1;
+
+	char *buf = ecalloc(sz + 1, sizeof(char)), *p = buf;
+	for (c = g->rawdoc->next; c; c = c->next) {
+		size_t l = strlen((char *)c->data);
+		memcpy(p, c->data, l);
+		p[l] = '\n', p += l + 1;
+	}
+
+	*len = sz;
+	return buf;
+}
+
 _Bool
 gemdoc_find_link(struct Gemdoc *g, size_t n, char **text, CURLU **url)
 {
+	if (!g) return false;
+
 	struct lnklist *c;
 	for (c = g->document->next; c; c = c->next) {
 		struct Gemtok *l = ((struct Gemtok *)c->data);
@@ -299,16 +451,19 @@ gemdoc_free(struct Gemdoc *g)
 		if (!c->data) continue;
 		struct Gemtok *l = ((struct Gemtok *)c->data);
 
-		if (l->type == GEM_DATA_LINK) {
+		if (l->type == GEM_DATA_LINK)
 			curl_url_cleanup(l->link_url);
-			if (l->raw_link_url) free(l->raw_link_url);
-		}
-
-		if (l->text) free(l->text);
 	}
 
-	if (g->rawdoc)   lnklist_free_all(g->rawdoc);
-	if (g->document) lnklist_free_all(g->document);
+	/* the lines themselves are in the slabs */
+	for (c = g->slabs->next; c; c = c->next)
+		slab_unref((struct Slab *)c->data);
+
+	/* and the tokens and list nodes (bar the heads) in the arena */
+	free(g->rawdoc), free(g->document);
+	arena_free(&g->arena);
+
+	if (g->slabs)    lnklist_free(g->slabs);
 	if (g->url)      curl_url_cleanup(g->url);
 
 	free(g);
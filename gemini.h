@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include "curl/url.h"
 #include "list.h"
+#include "slab.h"
 
 #define GEM_DATA_HEADER1   1
 #define GEM_DATA_HEADER2   2
@@ -46,6 +47,10 @@
 #define GEM_CHARSET_UTF7    3
 #define GEM_CHARSET_ASCII   4
 
+/* how a document's body is kept (and so, shown) */
+#define GEM_FORMAT_GEMTEXT 0 /* as tokens, in `document' */
+#define GEM_FORMAT_PLAIN   1 /* only as lines, in `rawdoc' */
+
 #define MAXTITLELEN 15
 
 struct Gemtok {
@@ -65,9 +70,20 @@ struct Gemdoc {
 	size_t encoding;
 	char title[MAXTITLELEN + 1];
 	char mimetype[32];
+	size_t format;
 
 	struct lnklist *document;
 	struct lnklist *rawdoc;
+
+	/* their last nodes, so that adding a line doesn't mean a walk */
+	struct lnklist *doctail;
+	struct lnklist *rawtail;
+
+	/* what the lines in rawdoc (and the tokens' text) point into */
+	struct lnklist *slabs;
+
+	/* what the tokens, and the nodes of both lists, are allocated out of */
+	struct Arena arena;
 };
 
 typedef struct Gemdoc_CTX gemdoc_ctx_t;
@@ -76,6 +92,10 @@ struct Gemdoc *gemdoc_new(CURLU *url);
 struct Gemdoc_CTX *gemdoc_parse_init(void);
 _Bool gemdoc_parse(struct Gemdoc_CTX *ctx, struct Gemdoc *g, char *line);
 _Bool gemdoc_parse_finish(struct Gemdoc_CTX *ctx, struct Gemdoc *g);
+void gemdoc_link(struct Gemdoc *g, struct lnklist *raw, struct lnklist *tok);
+void gemdoc_keep(struct Gemdoc *g, struct Slab *s);
+_Bool gemdoc_parse_buf(struct Gemdoc *g, char *buf, size_t len);
+char *gemdoc_serialize(struct Gemdoc *g, size_t *len);
 _Bool gemdoc_find_link(struct Gemdoc *g, size_t n, char **text, CURLU **url);
 _Bool gemdoc_free(struct Gemdoc *g);
 
@@ -0,0 +1,328 @@
+#include <ctype.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include "crawl.h"
+#include "curl/url.h"
+#include "fetch.h"
+#include "gemini.h"
+#include "loadgen.h"
+#include "util.h"
+
+/*
+ * Load-test a server with the same fetch layer (and so the same
+ * connection, TLS and parsing code) as the browser, and report how long
+ * each part of a request took.
+ *
+ * In closed-loop mode, a request that finishes is replaced right away.
+ * In open-loop mode, requests go out on schedule whether or not earlier
+ * ones have finished, and their latency is counted from when they were
+ * due; otherwise a server that falls behind would slow down the very
+ * requests it's being measured with, and look better than it is.
+ */
+
+#define POOL_MAX 4096 /* pages to crawl for URLs */
+
+#define FLAGS (FETCH_NOCACHE | FETCH_NOSAVE | FETCH_NOTHREAD \
+		| FETCH_NOSLOWDOWN | FETCH_NOSTORE)
+
+enum Phase {
+	PHASE_QUEUE,   /* from when it was due, until it went out */
+	PHASE_DNS,
+	PHASE_CONNECT,
+	PHASE_TLS,
+	PHASE_SEND,
+	PHASE_WAIT,    /* for the first of the response */
+	PHASE_RECEIVE, /* (and parse) the rest of it */
+	PHASE_TOTAL,
+	PHASE_MAX,
+};
+
+static const char *phase_names[] = {
+	[PHASE_QUEUE]   = "queue",   [PHASE_DNS]     = "dns",
+	[PHASE_CONNECT] = "connect", [PHASE_TLS]     = "tls",
+	[PHASE_SEND]    = "send",    [PHASE_WAIT]    = "wait",
+	[PHASE_RECEIVE] = "receive", [PHASE_TOTAL]   = "total",
+};
+
+static CURLU **pool = NULL;
+static size_t pool_len = 0, pool_cap = 0;
+
+/* how long (ms) each phase took, for each request that got a response */
+static double *samples[PHASE_MAX];
+static size_t nsamples = 0, samples_cap = 0;
+
+static size_t inflight = 0, responses = 0, failed = 0, bytes = 0;
+static size_t statuses[GEM_TYPE_NEEDCERT + 1];
+
+/* failures by FETCH_E* code, with what the first of each said */
+static size_t errors[-FETCH_ESAVE + 1];
+static char *error_msgs[-FETCH_ESAVE + 1];
+
+static double
+_ms_between(struct timeval *a, struct timeval *b)
+{
+	struct timeval d;
+	timersub(b, a, &d);
+	return d.tv_sec * 1e3 + d.tv_usec / 1e3;
+}
+
+static void
+_pool_push(CURLU *url)
+{
+	if (pool_len == pool_cap) {
+		pool_cap = pool_cap ? pool_cap * 2 : 64;
+		ENSURE((pool = realloc(pool, pool_cap * sizeof(CURLU *))));
+	}
+	pool[pool_len++] = url;
+}
+
+static void
+_load_list(char *path)
+{
+	FILE *fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!fp) die("unable to open %s:", path);
+
+	char *line = NULL;
+	size_t sz = 0;
+
+	while (getline(&line, &sz, fp) != -1) {
+		char *s = line, *end = line + strlen(line);
+		while (isspace(*s)) ++s;
+		while (end > s && isspace(end[-1])) *--end = '\0';
+		if (!*s || *s == '#')
+			continue;
+
+		CURLU *url = curl_url();
+		if (curl_url_set(url, CURLUPART_URL,
+				strstr(s, "://") ? s : format("gemini://%s", s), 0)) {
+			fprintf(stderr, "loadgen: skipping invalid URL '%s'\n", s);
+			curl_url_cleanup(url);
+			continue;
+		}
+		_pool_push(url);
+	}
+
+	free(line);
+	if (fp != stdin) fclose(fp);
+}
+
+/* anything that can't be fetched (or isn't text) is left out. */
+static void
+_crawled(struct Fetch *f, FILE *body, void *data)
+{
+	UNUSED(body), UNUSED(data);
+	if (f->status == 0)
+		_pool_push(curl_url_dup(f->doc->url));
+}
+
+static void
+_finished(struct Fetch *f)
+{
+	struct timeval *due = (struct timeval *)f->data;
+	--inflight;
+	bytes += f->received;
+
+	if (f->status != 0) {
+		size_t e = -f->status;
+		++failed;
+		if (e < SIZEOF(errors) && errors[e]++ == 0)
+			error_msgs[e] = strdup(f->error);
+		free(due);
+		return;
+	}
+
+	++responses;
+	if (f->doc->type < SIZEOF(statuses))
+		++statuses[f->doc->type];
+
+	if (nsamples == samples_cap) {
+		samples_cap = samples_cap ? samples_cap * 2 : 1024;
+		for (size_t i = 0; i < PHASE_MAX; ++i)
+			ENSURE((samples[i] = realloc(samples[i],
+				samples_cap * sizeof(double))));
+	}
+
+	/* where each phase starts (and the last one ends); a phase that was
+	 * skipped takes no time at all */
+	struct timeval at[] = {
+		*due, f->entered[FETCH_RESOLVE], f->entered[FETCH_CONNECT],
+		f->entered[FETCH_HANDSHAKE], f->entered[FETCH_SEND],
+		f->entered[FETCH_RECV], f->firstbyte, f->entered[FETCH_DONE],
+	};
+	for (size_t i = 1; i < SIZEOF(at); ++i)
+		if (!timerisset(&at[i]))
+			at[i] = at[i - 1];
+
+	for (size_t i = 0; i < PHASE_TOTAL; ++i)
+		samples[i][nsamples] = _ms_between(&at[i], &at[i + 1]);
+	samples[PHASE_TOTAL][nsamples++] = _ms_between(due, &at[PHASE_TOTAL]);
+
+	free(due);
+}
+
+static void
+_issue(struct timeval *due)
+{
+	static size_t next = 0;
+
+	struct timeval *d = ecalloc(1, sizeof(struct timeval));
+	*d = *due;
+	fetch_new(curl_url_dup(pool[next]), FETCH_PRIO_FOREGROUND,
+		FLAGS, &_finished, (void *)d);
+
+	next = (next + 1) % pool_len;
+	++inflight;
+}
+
+static int
+_cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* the nearest-rank percentile p (0-1) of n sorted samples. */
+static double
+_percentile(double *s, size_t n, double p)
+{
+	size_t rank = (size_t)(p * n);
+	if (rank < p * n) ++rank;
+	return s[rank ? rank - 1 : 0];
+}
+
+static void
+_report(double secs)
+{
+	printf("%zu requests in %.2fs: %zu responses, %zu failed\n",
+		responses + failed, secs, responses, failed);
+	printf("%.1f requests/s, %.2f MiB/s\n", (responses + failed) / secs,
+		bytes / secs / (1024 * 1024));
+
+	printf("responses:");
+	for (size_t i = 1; i < SIZEOF(statuses); ++i)
+		printf(" %zux %zu%s", i, statuses[i], i + 1 < SIZEOF(statuses) ? "," : "\n");
+
+	for (size_t i = 1; i < SIZEOF(errors); ++i)
+		if (errors[i])
+			printf("failed: %zu (e.g. %s)\n", errors[i], error_msgs[i]);
+
+	if (nsamples == 0)
+		return;
+
+	printf("\n%-10s %10s %10s %10s %10s\n", "phase (ms)", "p50", "p99",
+		"p999", "max");
+	for (size_t i = 0; i < PHASE_MAX; ++i) {
+		qsort(samples[i], nsamples, sizeof(double), &_cmp_double);
+		printf("%-10s %10.2f %10.2f %10.2f %10.2f\n", phase_names[i],
+			_percentile(samples[i], nsamples, 0.5),
+			_percentile(samples[i], nsamples, 0.99),
+			_percentile(samples[i], nsamples, 0.999),
+			samples[i][nsamples - 1]);
+	}
+}
+
+static void
+_cleanup(void)
+{
+	for (size_t i = 0; i < pool_len; ++i)
+		curl_url_cleanup(pool[i]);
+	free(pool);
+	pool = NULL, pool_len = pool_cap = 0;
+
+	for (size_t i = 0; i < PHASE_MAX; ++i)
+		free(samples[i]), samples[i] = NULL;
+	for (size_t i = 0; i < SIZEOF(error_msgs); ++i)
+		free(error_msgs[i]), error_msgs[i] = NULL;
+}
+
+/*
+ * Run a load test, and print what happened to stdout. Returns what to
+ * exit with: non-zero if nothing got a response.
+ */
+int
+loadgen_run(struct Loadgen *lg)
+{
+	if (!lg->concurrency && lg->rate <= 0)
+		lg->concurrency = 16;
+	if (!lg->requests && lg->duration <= 0)
+		lg->duration = 10;
+
+	/* every request needs a socket or two */
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if (lg->list) {
+		_load_list(lg->list);
+	} else {
+		struct Crawl c = {
+			.seed = lg->seed, .prefix = "/", .pages = POOL_MAX,
+			.flags = FLAGS & ~FETCH_NOSLOWDOWN, .page = &_crawled,
+		};
+		fprintf(stderr, "loadgen: crawling %s...\n", lg->seed);
+		crawl_run(&c);
+		fprintf(stderr, "loadgen: found %zu URLs.\n", pool_len);
+	}
+
+	if (pool_len == 0) {
+		fprintf(stderr, "loadgen: no URLs to request.\n");
+		_cleanup();
+		return 1;
+	}
+
+	/* the test itself sets the pace */
+	fetch_limit(SIZE_MAX, SIZE_MAX);
+
+	struct timeval start, now, due;
+	ENSURE(gettimeofday(&start, NULL) == 0);
+	size_t issued = 0;
+
+	for (;;) {
+		ENSURE(gettimeofday(&now, NULL) == 0);
+		double elapsed = _ms_between(&start, &now) / 1e3;
+		_Bool more = (!lg->requests || issued < lg->requests)
+			&& (lg->duration <= 0 || elapsed < lg->duration);
+
+		if (!more && inflight == 0)
+			break;
+
+		int timeout = 100;
+		if (more && lg->rate > 0) {
+			/* start everything that's due, as of when it was */
+			double at;
+			while ((at = issued / lg->rate) <= elapsed
+					&& (!lg->requests || issued < lg->requests)) {
+				due.tv_sec = (time_t)at;
+				due.tv_usec = (suseconds_t)((at - due.tv_sec) * 1e6);
+				timeradd(&start, &due, &due);
+				_issue(&due), ++issued;
+			}
+			timeout = MAX((int)((at - elapsed) * 1e3) + 1, timeout);
+		} else if (more) {
+			while (inflight < lg->concurrency
+					&& (!lg->requests || issued < lg->requests))
+				_issue(&now), ++issued;
+		}
+
+		if (fetch_active())
+			fetch_poll(timeout);
+		else
+			poll(NULL, 0, timeout);
+	}
+
+	ENSURE(gettimeofday(&now, NULL) == 0);
+	_report(_ms_between(&start, &now) / 1e3);
+	fetch_limit(0, 0);
+
+	int ret = responses == 0;
+	_cleanup();
+	return ret;
+}
@@ -0,0 +1,26 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <sys/types.h>
+
+/*
+ * What to load-test, and how. URLs come from `list' (a file of them, one
+ * per line, or "-" for stdin), or else from crawling the same-host links
+ * of `seed'. Either `concurrency' requests are kept in flight (closed
+ * loop), or requests go out at `rate' a second, however many are already
+ * in flight (open loop).
+ */
+struct Loadgen {
+	char *list, *seed;
+	size_t concurrency;
+	double rate;
+
+	/* stop after this many requests, or this many seconds (0 for no
+	 * limit; if neither is set, it's 10 seconds) */
+	size_t requests;
+	double duration;
+};
+
+int loadgen_run(struct Loadgen *lg);
+
+#endif
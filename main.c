@@ -2,6 +2,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <getopt.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -9,14 +10,25 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cache.h"
 #include "conn.h"
 #include "config.h"
+#include "crawl.h"
 #include "curl/url.h"
+#include "dns.h"
+#include "dump.h"
+#include "feeds.h"
+#include "fetch.h"
 #include "history.h"
 #include "gemini.h"
+#include "loadgen.h"
+#include "prefetch.h"
+#include "proxy.h"
+#include "store.h"
 #include "tabs.h"
 #include "tbrl.h"
 #include "termbox.h"
+#include "trace.h"
 #include "ui.h"
 #include "util.h"
 
@@ -32,149 +44,174 @@ handlesig(int sig)
 		sigstrs[sig] ? sigstrs[sig] : "???", sig);
 }
 
-static ssize_t
-make_request(struct Gemdoc **g, CURLU *url, char **e)
-{
-	ENSURE(g), ENSURE(url);
-
-	ssize_t status = 0;
-	*g = gemdoc_new(url);
-
-	char bufsrv[65536]; /* buffer for server data */
-	memset(bufsrv, 0x0, sizeof(bufsrv));
-	size_t rc = 0;      /* received */
-	ssize_t r = 0;      /* return code of conn_recv */
-	size_t max = sizeof(bufsrv) - 1;
-
-	CURLUcode err;
-	char *scheme, *host, *port, *clurl;
-
-	/* wait, did you say gopher? */
-	err = curl_url_get(url, CURLUPART_SCHEME, &scheme, 0);
-	if (err || strcmp(scheme, "gemini")) return -1;
-
-	conn_init();
-	err = curl_url_get(url, CURLUPART_HOST, &host, 0);
-	err = curl_url_get(url, CURLUPART_PORT, &port, 0);
-	err = curl_url_get(url, CURLUPART_URL, &clurl, 0);
-
-	if (!conn_conn(host, port ? port : "1965")) {
-		status = -2;
-		goto cleanup;
-	}
-
-	if (!conn_send(format("%s\r\n", clurl))) {
-		status = -3;
-		goto cleanup;
-	}
-
-	gemdoc_ctx_t *ctx = gemdoc_parse_init();
-
-	while ((r = conn_recv(bufsrv, max - 1 - rc)) != -1) {
-		if (r == -2) {
-			status = -4;
-			goto cleanup;
-		} else if (r == 0)
-			continue;
-
-		rc += r;
-		char *end, *ptr = (char *) &bufsrv;
-
-		while ((end = memchr(ptr, '\n', &bufsrv[rc] - ptr))) {
-			*end = '\0';
-			if (!gemdoc_parse(ctx, *g, ptr)) {
-				status = -5;
-				goto cleanup;
-			}
-			ptr = end + 1;
-		}
-
-		rc -= ptr - bufsrv;
-		memmove(&bufsrv, ptr, rc);
-	};
-
-	gemdoc_parse_finish(ctx, *g);
-
-cleanup:
-	free(scheme);
-	free(host);
-	free(port);
-	free(clurl);
-
-	if (status != 0 && e != NULL) {
-		*e = (char *)tls_error(client);
-		if (*e) *e = strdup(*e);
-		else *e = strdup(strerror(errno));
-	}
-
-	if (conn_active()) conn_close();
-	conn_shutdown();
-
-	return status;
-}
+static void tab_load(struct Tab *t, CURLU *url, int flags, size_t redirects);
 
 static void
-follow_link(CURLU *url, size_t redirects)
+tab_loaded(struct Fetch *f)
 {
-	/* take a copy, as url may be a reference to another gemdoc's
-	 * url, which we'll free separately */
-	url = curl_url_dup(url);
-
-	char *error;
-
-	struct Gemdoc *newdoc;
-	switch (make_request(&newdoc, url, &error)) {
-	break; case -1:;
-		char *scheme;
-		curl_url_get(url, CURLUPART_SCHEME, &scheme, 0);
-		ui_message(UI_STOP, "Unsupported URL scheme '%s'", scheme);
-		free(scheme);
-	break; case -2: case -3: case -4:;
-		ui_message(UI_STOP, "error: %s", error);
-		if (error) free(error);
-	break; case -5:
-		ui_message(UI_STOP, "Could not parse document.");
+	struct Tab *t = (struct Tab *)f->data;
+	struct Gemdoc *newdoc = f->doc;
+	t->fetch = NULL;
+
+	switch (f->status) {
+	break; case 0:
+		/* success */
+		if (f->saveto) {
+			ui_message(UI_INFO, "Saved %zu KiB to %s.",
+				f->received / 1024, f->saveto);
+			return;
+		}
+	break; case FETCH_ESCHEME: case FETCH_EPARSE:
+		ui_message(UI_STOP, "%s", f->error);
+		return;
+	break; default:
+		ui_message(UI_STOP, "error: %s", f->error);
+		return;
 	}
 
 	/* now let's check for input and redirects */
 	switch (newdoc->type) {
 	break; case GEM_TYPE_INPUT:
-		tbrl_setbuf(":input ");
+		if (t == CURTAB())
+			tbrl_setbuf(":input ");
 	break; case GEM_TYPE_REDIRECT:;
 		CURLUcode error;
 		CURLU *rurl = curl_url_dup(newdoc->url);
 		error = curl_url_set(rurl, CURLUPART_URL, newdoc->meta, 0);
 		if (error) {
 			ui_message(UI_WARN, "Invalid redirect URL.");
+			curl_url_cleanup(rurl);
 			goto show;
 		}
 
 		if (c_automatic_redirects
-				&& redirects < c_maximum_redirects) {
-			follow_link(rurl, redirects + 1);
-		} else {
+				&& t->redirects < c_maximum_redirects) {
+			tab_load(t, rurl, 0, t->redirects + 1);
+			curl_url_cleanup(rurl);
+			return;
+		} else if (t == CURTAB()) {
 			char *urlbuf;
 			curl_url_get(rurl, CURLUPART_URL, &urlbuf, 0);
 			tbrl_setbuf(format(":go %s", urlbuf));
 			free(urlbuf);
 		}
+		curl_url_cleanup(rurl);
 	}
 
 show:
-	hist_add(&CURTAB()->visited, newdoc);
+	/* show a stale response right away, and refresh the cache in the
+	 * background so that the next visit gets the new one */
+	if (f->cached && f->stale && !fetch_offline)
+		fetch_new(curl_url_dup(newdoc->url), t == CURTAB()
+			? FETCH_PRIO_VISIBLE : FETCH_PRIO_BACKGROUND,
+			FETCH_NOCACHE | FETCH_NOSAVE, NULL, NULL);
+
+	/* the tab owns the document now */
+	f->doc = NULL;
+	hist_add(&t->visited, newdoc);
+
+	if (t == CURTAB())
+		prefetch_page(newdoc);
+
 	ui_redraw();
 }
 
 static void
-newtab(CURLU *url)
+tab_cancel(struct Tab *t)
+{
+	if (!t->fetch) return;
+	fetch_cancel(t->fetch);
+	t->fetch = NULL;
+}
+
+/*
+ * Cancel the current tab's request before moving through its history.
+ * What's been read of a lazily loaded page is kept in the history, as in
+ * tab_load(). Returns true if the page on the screen was the request's
+ * and couldn't be kept; the page before it is then what's shown, as if
+ * we'd gone back already.
+ */
+static _Bool
+tab_interrupt(void)
+{
+	struct Tab *t = CURTAB();
+	if (!t->fetch) return false;
+
+	_Bool shown = ui_doc() != CURDOC();
+	struct Gemdoc *partial = fetch_take(t->fetch);
+	if (partial)
+		hist_add(&t->visited, partial);
+	tab_cancel(t);
+
+	return shown && !partial;
+}
+
+static void
+tab_load(struct Tab *t, CURLU *url, int flags, size_t redirects)
+{
+	/* only one request per tab at a time, though what's been read of
+	 * a lazily loaded page is worth keeping in the history */
+	struct Gemdoc *partial;
+	if (t->fetch && (partial = fetch_take(t->fetch)))
+		hist_add(&t->visited, partial);
+	tab_cancel(t);
+
+	/* carry on with the page if it's already being prefetched; if
+	 * not, take a copy, as url may be a reference to another gemdoc's
+	 * url, which we'll free separately */
+	enum FetchPriority prio = t == CURTAB()
+		? FETCH_PRIO_FOREGROUND : FETCH_PRIO_BACKGROUND;
+	if (!(t->fetch = prefetch_claim(url, prio, flags, &tab_loaded, (void *)t)))
+		t->fetch = fetch_new(curl_url_dup(url), prio,
+			flags, &tab_loaded, (void *)t);
+	t->redirects = redirects;
+}
+
+/*
+ * The current tab's request goes before any other tab's, and only as much
+ * of each page is read as is (or is about to be) on the screen.
+ */
+static void
+tabs_schedule(void)
+{
+	for (struct lnklist *l = tabs->next; l; l = l->next) {
+		struct Tab *t = (struct Tab *)l->data;
+		if (!t || !t->fetch)
+			continue;
+
+		fetch_prioritize(t->fetch, t == CURTAB()
+			? FETCH_PRIO_FOREGROUND : FETCH_PRIO_BACKGROUND);
+
+		if (c_lazy_lookahead > 0)
+			fetch_want(t->fetch, (t == CURTAB() ? t->ui_vscroll : 0)
+				+ tb_height() + c_lazy_lookahead);
+	}
+}
+
+static void
+follow_link(CURLU *url, size_t redirects)
+{
+	tab_load(CURTAB(), url, 0, redirects);
+	ui_redraw();
+}
+
+/*
+ * Open url in a new tab after `after', and return the new tab. The tab
+ * loads in the background; switching to it is up to the caller.
+ */
+static struct lnklist *
+newtab(struct lnklist *after, CURLU *url)
 {
-	tabs_add(curtab), curtab = curtab->next;
-	follow_link(url, 0);
+	tabs_add(after);
+	tab_load((struct Tab *)after->next->data, url, 0, 0);
+	return after->next;
 }
 
 static void
 editurl(void)
 {
+	if (!CURDOC()) return;
+
 	char *urlbuf;
 	curl_url_get(CURDOC()->url, CURLUPART_URL, &urlbuf, 0);
 	tbrl_setbuf(format(":go %s", urlbuf));
@@ -184,9 +221,157 @@ editurl(void)
 
 #include "commands.c"
 
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: mebs [-r trace | -R trace [-t scale]]\n");
+	fprintf(stderr, "       mebs -L [-c n | -q rate] [-n n] [-d secs] url-list | seed-url\n");
+	fprintf(stderr, "       mebs -M archive [-c n] [-n n] [-D depth] [-p prefix] seed-url\n");
+	fprintf(stderr, "       mebs -P port -C cert -K key\n");
+	fprintf(stderr, "       mebs -x [-f gemtext|text|json] [-w width] [-c n] [url...]\n");
+	fprintf(stderr, "  -r, --record FILE      record every connection to FILE\n");
+	fprintf(stderr, "  -R, --replay FILE      replay FILE instead of using the network\n");
+	fprintf(stderr, "  -t, --timescale SCALE  multiply replayed timings by SCALE (0: no delays)\n");
+	fprintf(stderr, "  -L, --loadgen          load-test the URLs in a file (- for stdin),\n");
+	fprintf(stderr, "                         or the pages linked from a seed URL\n");
+	fprintf(stderr, "  -M, --mirror ARCHIVE   crawl the capsule at a seed URL into ARCHIVE\n");
+	fprintf(stderr, "  -c, --concurrency N    keep N requests in flight (default: 16,\n");
+	fprintf(stderr, "                         c_crawl_concurrency for -M, or c_fetch_max\n");
+	fprintf(stderr, "                         for -x)\n");
+	fprintf(stderr, "  -q, --rate RATE        or, start RATE requests a second\n");
+	fprintf(stderr, "  -n, --requests N       stop after N requests\n");
+	fprintf(stderr, "  -d, --duration SECS    stop after SECS seconds (default: 10)\n");
+	fprintf(stderr, "  -D, --depth N          only follow links N deep\n");
+	fprintf(stderr, "  -p, --prefix PATH      only follow links under PATH (default: the\n");
+	fprintf(stderr, "                         seed's directory)\n");
+	fprintf(stderr, "  -P, --proxy PORT       serve proxy requests on PORT\n");
+	fprintf(stderr, "  -C, --cert FILE        the proxy's certificate\n");
+	fprintf(stderr, "  -K, --key FILE         and its key\n");
+	fprintf(stderr, "  -x, --dump             write the pages at each URL (or each URL read\n");
+	fprintf(stderr, "                         from stdin) to stdout, in order\n");
+	fprintf(stderr, "  -f, --format FORMAT    as gemtext (the default), text, or json\n");
+	fprintf(stderr, "  -w, --width N          wrap text at N columns (default: 80; 0 not to)\n");
+	exit(1);
+}
+
 int
-main(void)
+main(int argc, char **argv)
 {
+	static const struct option longopts[] = {
+		{ "record",      required_argument, NULL, 'r' },
+		{ "replay",      required_argument, NULL, 'R' },
+		{ "timescale",   required_argument, NULL, 't' },
+		{ "loadgen",     no_argument,       NULL, 'L' },
+		{ "concurrency", required_argument, NULL, 'c' },
+		{ "rate",        required_argument, NULL, 'q' },
+		{ "requests",    required_argument, NULL, 'n' },
+		{ "duration",    required_argument, NULL, 'd' },
+		{ "mirror",      required_argument, NULL, 'M' },
+		{ "depth",       required_argument, NULL, 'D' },
+		{ "prefix",      required_argument, NULL, 'p' },
+		{ "proxy",       required_argument, NULL, 'P' },
+		{ "cert",        required_argument, NULL, 'C' },
+		{ "key",         required_argument, NULL, 'K' },
+		{ "dump",        no_argument,       NULL, 'x' },
+		{ "format",      required_argument, NULL, 'f' },
+		{ "width",       required_argument, NULL, 'w' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	char *record = NULL, *replay = NULL, *end;
+	double timescale = 1.0;
+	char *mirror = NULL, *proxy = NULL, *cert = NULL, *key = NULL;
+	_Bool loadgen = false, dump = false;
+	struct Loadgen lg = { 0 };
+	struct Crawl crawl = { 0 };
+	struct Dump dd = { .format = DUMP_GEMTEXT, .width = 80 };
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "r:R:t:Lc:q:n:d:M:D:p:P:C:K:xf:w:", longopts, NULL)) != -1) {
+		switch (opt) {
+		break; case 'r':
+			record = optarg;
+		break; case 'R':
+			replay = optarg;
+		break; case 't':
+			timescale = strtod(optarg, &end);
+			if (end == optarg || *end || timescale < 0)
+				usage();
+		break; case 'L':
+			loadgen = true;
+		break; case 'c':
+			lg.concurrency = strtoul(optarg, &end, 10);
+			if (end == optarg || *end || !lg.concurrency)
+				usage();
+		break; case 'q':
+			lg.rate = strtod(optarg, &end);
+			if (end == optarg || *end || lg.rate <= 0)
+				usage();
+		break; case 'n':
+			lg.requests = strtoul(optarg, &end, 10);
+			if (end == optarg || *end)
+				usage();
+		break; case 'd':
+			lg.duration = strtod(optarg, &end);
+			if (end == optarg || *end || lg.duration < 0)
+				usage();
+		break; case 'M':
+			mirror = optarg;
+		break; case 'D':
+			crawl.depth = strtoul(optarg, &end, 10);
+			if (end == optarg || *end)
+				usage();
+		break; case 'p':
+			crawl.prefix = optarg;
+		break; case 'P':
+			proxy = optarg;
+		break; case 'C':
+			cert = optarg;
+		break; case 'K':
+			key = optarg;
+		break; case 'x':
+			dump = true;
+		break; case 'f':
+			if (!strcmp(optarg, "gemtext"))
+				dd.format = DUMP_GEMTEXT;
+			else if (!strcmp(optarg, "text"))
+				dd.format = DUMP_TEXT;
+			else if (!strcmp(optarg, "json"))
+				dd.format = DUMP_JSON;
+			else
+				usage();
+		break; case 'w':
+			dd.width = strtoul(optarg, &end, 10);
+			if (end == optarg || *end)
+				usage();
+		break; default:
+			usage();
+		}
+	}
+
+	if ((!dump && optind + (loadgen || mirror) != argc) || (record && replay)
+			|| loadgen + !!mirror + !!proxy + dump > 1
+			|| (lg.concurrency && lg.rate > 0)
+			|| (proxy && (!cert || !key)))
+		usage();
+
+	if (loadgen) {
+		if (strstr(argv[optind], "://"))
+			lg.seed = argv[optind];
+		else
+			lg.list = argv[optind];
+	} else if (mirror) {
+		crawl.seed = argv[optind];
+		crawl.concurrency = lg.concurrency;
+		crawl.pages = lg.requests;
+	} else if (dump) {
+		/* a lone "-" is the same as no URLs at all */
+		dd.urls = &argv[optind], dd.nurls = argc - optind;
+		if (dd.nurls == 1 && !strcmp(dd.urls[0], "-"))
+			dd.nurls = 0;
+		dd.concurrency = lg.concurrency;
+	}
+
 	/* register signal handlers */
 	signal(SIGPIPE, SIG_IGN);
 	struct sigaction hnd = { .sa_handler = &handlesig };
@@ -197,10 +382,36 @@ main(void)
 	CURLU *homepage_curl = curl_url();
 	curl_url_set(homepage_curl, CURLUPART_URL, homepage, 0);
 
+	if (record && !trace_record(record))
+		die("unable to record to %s:", record);
+	if (replay && !trace_replay(replay, timescale))
+		die("unable to replay %s:", replay);
+
+	ENSURE(conn_init());
+
+	/* none of these need the screen, and only the proxy (which shares
+	 * its cache) needs the store */
+	if (loadgen || mirror || proxy || dump) {
+		if (proxy) store_init();
+		int status = loadgen ? loadgen_run(&lg)
+			: mirror ? crawl_mirror(&crawl, mirror)
+			: dump ? dump_run(&dd)
+			: proxy_run(proxy, cert, key);
+		cache_free();
+		store_free();
+		conn_shutdown();
+		trace_finish();
+		dns_flush();
+		curl_url_cleanup(homepage_curl);
+		return status;
+	}
+
+	store_init();
+	fetch_offline = c_offline;
 	ui_init();
 	tabs_init();
 
-	newtab(curl_url_dup(homepage_curl));
+	curtab = newtab(curtab, homepage_curl);
 	ui_redraw();
 
 	tbrl_init();
@@ -216,7 +427,14 @@ main(void)
 	while ("the web sucks" && !quit) {
 		ui_present();
 
-		if ((ret = tb_peek_event(&ev, 16)) == 0)
+		/* drive any in-flight requests, and only block on
+		 * termbox if there aren't any */
+		tabs_schedule();
+		prefetch_poll();
+		if (fetch_poll(16) > 0)
+			ui_redraw();
+
+		if ((ret = tb_peek_event(&ev, fetch_active() ? 0 : 16)) == 0)
 			continue;
 		ENSURE(ret != -1); /* termbox error */
 
@@ -229,13 +447,23 @@ main(void)
 		if (ev.type == TB_EVENT_KEY && ev.key) {
 			switch (ev.key) {
 			break; case TB_KEY_CTRL_C:
-				quit = true;
+				if (CURTAB()->fetch) {
+					tab_cancel(CURTAB());
+					ui_message(UI_INFO, "Cancelled.");
+				} else {
+					quit = true;
+				}
+			break; case TB_KEY_ESC:
+				if (CURTAB()->fetch) {
+					tab_cancel(CURTAB());
+					ui_message(UI_INFO, "Cancelled.");
+				}
 			break; case TB_KEY_CTRL_L:
 				/* redraw */
 			break; case TB_KEY_SPACE:
 				CURTAB()->ui_vscroll += tb_height();
 			break; case TB_KEY_CTRL_T:
-				newtab(curl_url_dup(homepage_curl));
+				curtab = newtab(curtab, homepage_curl);
 			break; case TB_KEY_CTRL_W:
 				if (!curtab || tabs_len() == 1)
 					break;
@@ -267,7 +495,7 @@ main(void)
 				CURLU *u = NULL;
 				size_t l = ev.ch - '0';
 
-				if (!gemdoc_find_link(CURDOC(), l, NULL, &u))
+				if (!gemdoc_find_link(ui_doc(), l, NULL, &u))
 					break;
 
 				follow_link(u, 0);
@@ -287,11 +515,17 @@ main(void)
 			break; case 'l':
 				++CURTAB()->ui_hscroll;
 			break; case 'b':
-				hist_back(&CURTAB()->visited);
+				if (!tab_interrupt())
+					hist_back(&CURTAB()->visited);
 			break; case 'f':
-				hist_forw(&CURTAB()->visited);
+				if (!tab_interrupt())
+					hist_forw(&CURTAB()->visited);
 			break; case 'r':
-				follow_link(CURDOC()->url, 0);
+				/* reloading skips the cache */
+				if (ui_doc()) {
+					tab_load(CURTAB(), ui_doc()->url, FETCH_NOCACHE, 0);
+					ui_redraw();
+				}
 			break; case ':':
 				tbrl_handle(&ev);
 			break; case ';':
@@ -310,6 +544,13 @@ main(void)
 
 	ui_shutdown();
 	tabs_free();
+	prefetch_free();
+	feeds_free();
+	cache_free();
+	store_free();
+	conn_shutdown();
+	trace_finish();
+	dns_flush();
 	curl_url_cleanup(homepage_curl);
 
 	return 0;
@@ -0,0 +1,246 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "gemini.h"
+#include "list.h"
+#include "parser.h"
+#include "ring.h"
+#include "slab.h"
+#include "util.h"
+
+/*
+ * Lines of the response go to the parser thread through `in', and come
+ * back through `out' along with their tokens. The lines aren't copied, so
+ * whoever feeds them in has to keep them around (see gemdoc_keep()). The
+ * parser writes to `notify' whenever it's got something to collect.
+ */
+struct Parser {
+	pthread_t thread;
+	gemdoc_ctx_t *ctx;
+	struct Gemdoc *doc;
+
+	/* only touched by the parser thread, after parser_new(). What's
+	 * parsed is allocated out of its arena, which is handed over to
+	 * doc's in parser_free(). */
+	struct Gemdoc *scratch;
+
+	struct Ring *in, *out;
+	sem_t input, space;
+	int notify[2];
+	atomic_bool stop, finished, failed;
+};
+
+/* fed in after the last line */
+static char eof[1];
+
+/* a line's list nodes, ready to be linked into the document's lists */
+struct ParsedLine {
+	struct lnklist *raw;
+	struct lnklist *tok;
+};
+
+static void
+_notify(struct Parser *p)
+{
+	/* if the pipe's full, there's a wakeup pending already */
+	while (write(p->notify[1], "", 1) == -1 && errno == EINTR);
+}
+
+static _Bool
+_emit(struct Parser *p, struct ParsedLine *pl)
+{
+	if (sem_trywait(&p->space) == -1) {
+		/* out of room; make sure the main thread knows to make some */
+		_notify(p);
+		while (sem_wait(&p->space) == -1)
+			ENSURE(errno == EINTR);
+	}
+
+	if (atomic_load(&p->stop)) {
+		gemdoc_link(p->scratch, pl->raw, pl->tok);
+		return false;
+	}
+
+	ENSURE(ring_push(p->out, pl));
+	return true;
+}
+
+static _Bool
+_parse_line(struct Parser *p, char *line)
+{
+	if (!gemdoc_parse(p->ctx, p->scratch, line))
+		return false;
+
+	/* gemdoc_parse() leaves the line (and its token, if any) as the
+	 * only node in the scratch document's lists; pass them on */
+	if (!p->scratch->rawdoc->next)
+		return true;
+
+	struct ParsedLine *pl = arena_alloc(&p->scratch->arena,
+		sizeof(struct ParsedLine));
+	pl->raw = p->scratch->rawdoc->next;
+	pl->tok = p->scratch->document->next;
+	p->scratch->rawdoc->next = p->scratch->document->next = NULL;
+	p->scratch->rawtail = p->scratch->rawdoc;
+	p->scratch->doctail = p->scratch->document;
+
+	return _emit(p, pl);
+}
+
+static void *
+_parser_run(void *arg)
+{
+	struct Parser *p = (struct Parser *)arg;
+	_Bool ok = true;
+
+	while (ok) {
+		if (sem_trywait(&p->input) == -1) {
+			/* caught up; have what's been done collected */
+			_notify(p);
+			while (sem_wait(&p->input) == -1)
+				ENSURE(errno == EINTR);
+		}
+		if (atomic_load(&p->stop))
+			break;
+
+		char *line = (char *)ring_pop(p->in);
+		ENSURE(line);
+		if (line == eof)
+			break;
+
+		ok = _parse_line(p, line);
+	}
+
+	atomic_store(&p->failed, !ok);
+	atomic_store(&p->finished, true);
+	_notify(p);
+	return NULL;
+}
+
+/*
+ * Start parsing the rest of g's body, carrying on from where ctx left off
+ * (i.e. just after the response line). ctx belongs to the parser now.
+ */
+struct Parser *
+parser_new(gemdoc_ctx_t *ctx, struct Gemdoc *g)
+{
+	struct Parser *p = ecalloc(1, sizeof(struct Parser));
+	p->ctx = ctx;
+	p->doc = g;
+
+	/* link URLs are resolved against the document's, so the scratch
+	 * document needs a URL of its own */
+	p->scratch = gemdoc_new(curl_url_dup(g->url));
+	p->scratch->status = g->status, p->scratch->type = g->type;
+	p->scratch->format = g->format;
+	strcpy(p->scratch->mimetype, g->mimetype);
+
+	p->in = ring_new(c_parse_ring_size);
+	p->out = ring_new(c_parse_ring_size);
+	ENSURE(sem_init(&p->input, 0, 0) == 0);
+	ENSURE(sem_init(&p->space, 0, c_parse_ring_size) == 0);
+	atomic_init(&p->stop, false);
+	atomic_init(&p->finished, false);
+	atomic_init(&p->failed, false);
+
+	ENSURE(pipe(p->notify) == 0);
+	ENSURE(fcntl(p->notify[0], F_SETFL, O_NONBLOCK) == 0);
+	ENSURE(fcntl(p->notify[1], F_SETFL, O_NONBLOCK) == 0);
+
+	ENSURE(pthread_create(&p->thread, NULL, &_parser_run, (void *)p) == 0);
+	return p;
+}
+
+/* queue a line; returns false if there's no room for it yet. */
+_Bool
+parser_feed(struct Parser *p, char *line)
+{
+	if (!ring_push(p->in, (void *)line))
+		return false;
+
+	sem_post(&p->input);
+	return true;
+}
+
+/* that's the whole body; returns false if there's no room to say so yet. */
+_Bool
+parser_finish(struct Parser *p)
+{
+	return parser_feed(p, eof);
+}
+
+_Bool
+parser_full(struct Parser *p)
+{
+	return ring_full(p->in);
+}
+
+/*
+ * Move whatever's been parsed into g (the document the parser was started
+ * on), adding the number of lines to *lines, and return whether the
+ * parser's finished (or has failed).
+ */
+int
+parser_collect(struct Parser *p, struct Gemdoc *g, size_t *lines)
+{
+	char buf[64];
+	while (read(p->notify[0], buf, sizeof(buf)) > 0);
+
+	/* check before collecting, so nothing's left behind if the parser
+	 * finishes in the meantime */
+	_Bool finished = atomic_load(&p->finished);
+
+	struct ParsedLine *pl;
+	while ((pl = (struct ParsedLine *)ring_pop(p->out))) {
+		sem_post(&p->space);
+		gemdoc_link(g, pl->raw, pl->tok);
+		++*lines;
+	}
+
+	if (!finished)
+		return PARSER_RUNNING;
+	return atomic_load(&p->failed) ? PARSER_FAILED : PARSER_DONE;
+}
+
+int
+parser_fd(struct Parser *p)
+{
+	return p->notify[0];
+}
+
+/* stop the parser, and hand back its parser state. */
+gemdoc_ctx_t *
+parser_free(struct Parser *p)
+{
+	atomic_store(&p->stop, true);
+	sem_post(&p->input);
+	sem_post(&p->space);
+	pthread_join(p->thread, NULL);
+
+	/* let gemdoc_free() deal with anything that wasn't collected */
+	struct ParsedLine *pl;
+	while ((pl = (struct ParsedLine *)ring_pop(p->out)))
+		gemdoc_link(p->scratch, pl->raw, pl->tok);
+
+	/* what was collected lives on in doc */
+	arena_merge(&p->doc->arena, &p->scratch->arena);
+	gemdoc_free(p->scratch);
+	ring_free(p->in);
+	ring_free(p->out);
+	sem_destroy(&p->input);
+	sem_destroy(&p->space);
+	close(p->notify[0]);
+	close(p->notify[1]);
+
+	gemdoc_ctx_t *ctx = p->ctx;
+	free(p);
+	return ctx;
+}
@@ -0,0 +1,25 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <sys/types.h>
+#include "gemini.h"
+
+/*
+ * Parses the body of a response on a thread of its own, so that parsing
+ * one line overlaps with receiving (and decrypting) the next.
+ */
+struct Parser;
+
+#define PARSER_FAILED  -1
+#define PARSER_RUNNING  0
+#define PARSER_DONE     1
+
+struct Parser *parser_new(gemdoc_ctx_t *ctx, struct Gemdoc *g);
+_Bool parser_feed(struct Parser *p, char *line);
+_Bool parser_finish(struct Parser *p);
+_Bool parser_full(struct Parser *p);
+int   parser_collect(struct Parser *p, struct Gemdoc *g, size_t *lines);
+int   parser_fd(struct Parser *p);
+gemdoc_ctx_t *parser_free(struct Parser *p);
+
+#endif
@@ -0,0 +1,228 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "cache.h"
+#include "config.h"
+#include "curl/url.h"
+#include "fetch.h"
+#include "gemini.h"
+#include "list.h"
+#include "prefetch.h"
+#include "util.h"
+
+/*
+ * Links from the current page that are waiting to be prefetched (CURLU *),
+ * and the prefetches in progress (struct Fetch *). Every page gets a fresh
+ * budget of c_prefetch_max_requests requests and c_prefetch_max_bytes bytes.
+ */
+static struct lnklist *queue = NULL;
+static struct lnklist *running = NULL;
+static size_t requests = 0, bytes = 0;
+
+static void
+_init(void)
+{
+	if (queue) return;
+	queue = lnklist_new();
+	running = lnklist_new();
+}
+
+static _Bool
+_same_host(CURLU *a, CURLU *b)
+{
+	char *ahost = NULL, *bhost = NULL, *aport = NULL, *bport = NULL;
+	_Bool same = false;
+
+	curl_url_get(a, CURLUPART_HOST, &ahost, 0);
+	curl_url_get(b, CURLUPART_HOST, &bhost, 0);
+	curl_url_get(a, CURLUPART_PORT, &aport, 0);
+	curl_url_get(b, CURLUPART_PORT, &bport, 0);
+
+	/* gemini://h/ and gemini://H:1965/ are the same host */
+	same = ahost && bhost && !strcasecmp(ahost, bhost)
+		&& !strcmp(aport ? aport : "1965", bport ? bport : "1965");
+
+	free(ahost), free(bhost);
+	free(aport), free(bport);
+	return same;
+}
+
+static void
+_clear_queue(void)
+{
+	struct lnklist *l;
+	for (l = queue->next; l; l = l->next)
+		curl_url_cleanup((CURLU *)l->data);
+	lnklist_free(queue);
+	queue = lnklist_new();
+}
+
+static void
+_prefetch_done(struct Fetch *f)
+{
+	for (struct lnklist *l = running->next; l; l = l->next) {
+		if (l->data == (void *)f) {
+			lnklist_rm(l);
+			break;
+		}
+	}
+
+	/* successful responses have been cached, and 44s noted, by the
+	 * fetch itself */
+	bytes += f->received;
+}
+
+/*
+ * Queue the same-host links on a freshly loaded page for prefetching,
+ * dropping whatever was queued for the previous page.
+ */
+void
+prefetch_page(struct Gemdoc *g)
+{
+	if (!c_prefetch || g->type != GEM_TYPE_SUCCESS
+			|| strcmp(g->mimetype, "text/gemini"))
+		return;
+
+	_init();
+	_clear_queue();
+	requests = bytes = 0;
+
+	for (struct lnklist *c = g->document->next; c; c = c->next) {
+		struct Gemtok *t = (struct Gemtok *)c->data;
+		if (t->type != GEM_DATA_LINK || !t->link_url)
+			continue;
+
+		char *scheme = NULL;
+		curl_url_get(t->link_url, CURLUPART_SCHEME, &scheme, 0);
+		_Bool gemini = scheme && !strcmp(scheme, "gemini");
+		free(scheme);
+
+		if (!gemini || !_same_host(g->url, t->link_url))
+			continue;
+
+		char *key = cache_key(t->link_url);
+		_Bool skip = !key || cache_contains(key);
+
+		/* skip duplicates */
+		for (struct lnklist *l = queue->next; !skip && l; l = l->next) {
+			char *other = cache_key((CURLU *)l->data);
+			skip = other && !strcmp(key, other);
+			free(other);
+		}
+
+		free(key);
+		if (!skip)
+			lnklist_push(queue, (void *)curl_url_dup(t->link_url));
+	}
+}
+
+/*
+ * Start queued prefetches while there's room in the budget, and drop any
+ * that go over it.
+ */
+void
+prefetch_poll(void)
+{
+	if (!queue || fetch_offline) return;
+
+	struct lnklist *l, *next;
+
+	for (l = running->next; l; l = next) {
+		next = l->next;
+		struct Fetch *f = (struct Fetch *)l->data;
+		if (bytes + f->received > c_prefetch_max_bytes) {
+			bytes += f->received;
+			fetch_cancel(f);
+			lnklist_rm(l);
+		}
+	}
+
+	while (queue->next && requests < c_prefetch_max_requests
+			&& bytes < c_prefetch_max_bytes
+			&& (size_t)lnklist_len(running) < c_prefetch_concurrency) {
+		CURLU *url = (CURLU *)queue->next->data;
+		lnklist_rm(queue->next);
+
+		char *key = cache_key(url);
+		_Bool skip = !key || cache_contains(key) || fetch_slowed_down(url);
+		free(key);
+
+		if (skip) {
+			curl_url_cleanup(url);
+			continue;
+		}
+
+		++requests;
+		lnklist_push(running, (void *)fetch_new(url,
+			FETCH_PRIO_PREFETCH, FETCH_NOSAVE, &_prefetch_done, NULL));
+	}
+}
+
+/*
+ * If url's being prefetched, hand the fetch over, to carry on as though
+ * fetch_new() had been called with the rest of the arguments; otherwise
+ * return NULL. Either way, url won't be prefetched (again).
+ */
+struct Fetch *
+prefetch_claim(CURLU *url, enum FetchPriority priority, int flags,
+		fetch_func_t done, void *data)
+{
+	char *key;
+	if (!queue || !(key = cache_key(url)))
+		return NULL;
+
+	struct lnklist *l, *next;
+	struct Fetch *claimed = NULL;
+
+	for (l = queue->next; l; l = next) {
+		next = l->next;
+		char *other = cache_key((CURLU *)l->data);
+		if (other && !strcmp(key, other)) {
+			curl_url_cleanup((CURLU *)l->data);
+			lnklist_rm(l);
+		}
+		free(other);
+	}
+
+	/* a reload wants a fresh response, not whatever's on its way */
+	for (l = running->next; l && !BITSET(flags, FETCH_NOCACHE); l = l->next) {
+		struct Fetch *f = (struct Fetch *)l->data;
+		char *other = cache_key(f->doc->url);
+		_Bool same = other && !strcmp(key, other);
+		free(other);
+
+		if (!same)
+			continue;
+
+		/* flags are only looked at once the header's in; if it
+		 * already is, it's text (prefetches fail on anything else),
+		 * and none of them make a difference */
+		lnklist_rm(l);
+		bytes += f->received;
+		fetch_prioritize(f, priority);
+		f->flags = flags;
+		f->done = done, f->data = data;
+		claimed = f;
+		break;
+	}
+
+	free(key);
+	return claimed;
+}
+
+void
+prefetch_free(void)
+{
+	if (!queue) return;
+
+	_clear_queue();
+	lnklist_free(queue);
+
+	for (struct lnklist *l = running->next; l; l = l->next)
+		fetch_cancel((struct Fetch *)l->data);
+	lnklist_free(running);
+
+	queue = running = NULL;
+}
@@ -0,0 +1,13 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include "fetch.h"
+#include "gemini.h"
+
+void prefetch_page(struct Gemdoc *g);
+void prefetch_poll(void);
+struct Fetch *prefetch_claim(CURLU *url, enum FetchPriority priority,
+		int flags, fetch_func_t done, void *data);
+void prefetch_free(void);
+
+#endif
@@ -0,0 +1,480 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "config.h"
+#include "curl/url.h"
+#include "fetch.h"
+#include "gemini.h"
+#include "list.h"
+#include "proxy.h"
+#include "util.h"
+
+/*
+ * A caching proxy. Clients send it requests for any gemini:// URL, which
+ * it fetches (or serves from the cache, like any other fetch) and passes
+ * on. Requests for a URL that's already being fetched wait for that
+ * fetch rather than making their own; a `flight' is a fetch, and the
+ * clients waiting on it.
+ *
+ * Clients are stepped through their states in the same way as fetches
+ * (see fetch.c), from the same poll(2).
+ */
+enum ClientState {
+	CLIENT_HANDSHAKE,
+	CLIENT_READ,
+	CLIENT_WAIT,  /* on a flight */
+	CLIENT_WRITE,
+	CLIENT_CLOSE,
+	CLIENT_DONE,
+};
+
+struct Flight;
+
+struct Client {
+	enum ClientState state;
+	int fd;
+	struct tls *tls;
+	short events, revents; /* events is 0 unless libtls is waiting */
+	struct timeval deadline;
+
+	char request[1024 + 3];
+	size_t reqlen;
+
+	struct Flight *flight;
+	char *response;
+	size_t len, sent;
+};
+
+struct Flight {
+	char *key;
+	struct Fetch *fetch;
+	struct lnklist *waiting;
+	FILE *body; /* for a response that isn't text */
+};
+
+static struct tls *server = NULL;
+static struct lnklist *clients = NULL, *flights = NULL;
+static volatile sig_atomic_t stopping = 0;
+
+static struct {
+	size_t requests, joined, fetched, hits, refused;
+} stats;
+
+static void
+_stop(int sig)
+{
+	UNUSED(sig);
+	stopping = 1;
+}
+
+static void
+_client_deadline(struct Client *c)
+{
+	ENSURE(gettimeofday(&c->deadline, NULL) == 0);
+	c->deadline.tv_sec += c_read_timeout;
+}
+
+/* send response (which the client takes) and hang up. */
+static void
+_respond(struct Client *c, char *response, size_t len)
+{
+	c->response = response, c->len = len, c->sent = 0;
+	c->state = CLIENT_WRITE;
+	c->events = 0;
+	_client_deadline(c);
+}
+
+static void
+_refuse(struct Client *c, char *response)
+{
+	++stats.refused;
+	_respond(c, strdup(response), strlen(response));
+}
+
+/* the whole of f's response, as it'd be sent by the server. */
+static char *
+_response(struct Fetch *f, FILE *body, size_t *len)
+{
+	char header[1100];
+	size_t hlen, blen = 0;
+	char *serialized = NULL, *b = NULL;
+
+	if (f->status != 0) {
+		hlen = snprintf(header, sizeof(header), "%d %s\r\n",
+			GEM_STATUS_PROXYERROR, f->error);
+	} else {
+		hlen = snprintf(header, sizeof(header), "%zu %s\r\n",
+			f->doc->status, f->doc->meta);
+	}
+	hlen = MAX(hlen, sizeof(header) - 1);
+
+	struct stat st;
+	if (f->status == 0 && f->saveto && body && fstat(fileno(body), &st) == 0) {
+		fseek(body, 0, SEEK_SET);
+		b = serialized = ecalloc(st.st_size + 1, 1);
+		blen = fread(b, 1, st.st_size, body);
+	} else if (f->status == 0 && f->doc->type == GEM_TYPE_SUCCESS) {
+		/* everything after the response line */
+		serialized = gemdoc_serialize(f->doc, &blen);
+		b = strchr(serialized, '\n');
+		b = b ? b + 1 : serialized + blen;
+		blen -= b - serialized;
+	}
+
+	char *response = ecalloc(hlen + blen + 1, 1);
+	memcpy(response, header, hlen);
+	if (blen) memcpy(response + hlen, b, blen);
+	free(serialized);
+
+	*len = hlen + blen;
+	return response;
+}
+
+static void
+_flight_free(struct Flight *fl)
+{
+	for (struct lnklist *l = flights->next; l; l = l->next) {
+		if (l->data == (void *)fl) {
+			lnklist_rm(l);
+			break;
+		}
+	}
+
+	for (struct lnklist *l = fl->waiting->next; l; l = l->next)
+		((struct Client *)l->data)->flight = NULL;
+	lnklist_free(fl->waiting);
+
+	if (fl->body) fclose(fl->body);
+	free(fl->key);
+	free(fl);
+}
+
+static void
+_flight_done(struct Fetch *f)
+{
+	struct Flight *fl = (struct Flight *)f->data;
+	fl->fetch = NULL;
+
+	if (f->cached) ++stats.hits;
+
+	/* as with the browser, a stale response is passed on right away,
+	 * and refreshed for next time */
+	if (f->cached && f->stale && !fetch_offline)
+		fetch_new(curl_url_dup(f->doc->url), FETCH_PRIO_BACKGROUND,
+			FETCH_NOCACHE | FETCH_NOSAVE, NULL, NULL);
+
+	size_t len;
+	char *response = _response(f, fl->body, &len);
+
+	for (struct lnklist *l = fl->waiting->next; l; l = l->next) {
+		char *copy = ecalloc(len + 1, 1);
+		memcpy(copy, response, len);
+		_respond((struct Client *)l->data, copy, len);
+	}
+
+	free(response);
+	_flight_free(fl);
+}
+
+/* start on (or wait for) what c asked for. */
+static void
+_dispatch(struct Client *c)
+{
+	CURLU *url = curl_url();
+	char *scheme = NULL, *key = NULL;
+	++stats.requests;
+
+	if (curl_url_set(url, CURLUPART_URL, c->request, 0)
+			|| curl_url_get(url, CURLUPART_SCHEME, &scheme, 0)
+			|| !(key = cache_key(url))) {
+		_refuse(c, "59 Bad request\r\n");
+		goto cleanup;
+	}
+
+	if (strcmp(scheme, "gemini")) {
+		_refuse(c, "53 Only gemini:// URLs are proxied\r\n");
+		goto cleanup;
+	}
+
+	struct Flight *fl = NULL;
+	for (struct lnklist *l = flights->next; l && !fl; l = l->next)
+		if (!strcmp(((struct Flight *)l->data)->key, key))
+			fl = (struct Flight *)l->data;
+
+	if (fl) {
+		++stats.joined;
+	} else {
+		++stats.fetched;
+		fl = ecalloc(1, sizeof(struct Flight));
+		fl->key = key, key = NULL;
+		fl->waiting = lnklist_new();
+		lnklist_push(flights, (void *)fl);
+
+		/* anything that isn't text is passed on from a temporary
+		 * file, rather than saved */
+		int flags = (fl->body = tmpfile()) ? FETCH_SAVEFD : FETCH_NOSAVE;
+		fl->fetch = fetch_new(url, FETCH_PRIO_FOREGROUND, flags,
+			&_flight_done, (void *)fl);
+		if (fl->body)
+			fl->fetch->savefd = fileno(fl->body);
+		url = NULL;
+	}
+
+	lnklist_push(fl->waiting, (void *)c);
+	c->flight = fl;
+	c->state = CLIENT_WAIT;
+	c->events = 0;
+
+cleanup:
+	if (url) curl_url_cleanup(url);
+	free(scheme);
+	free(key);
+}
+
+/* whether libtls has to wait on c's socket; if so, for what. */
+static _Bool
+_client_wants(struct Client *c, ssize_t r)
+{
+	if (r == TLS_WANT_POLLIN)
+		c->events = POLLIN;
+	else if (r == TLS_WANT_POLLOUT)
+		c->events = POLLOUT;
+	else
+		return false;
+	return true;
+}
+
+/* advance c as far as it'll go; returns true if it can go further. */
+static _Bool
+_client_step(struct Client *c)
+{
+	ssize_t r;
+	char *crlf;
+	c->events = 0;
+
+	switch (c->state) {
+	break; case CLIENT_HANDSHAKE:
+		if (_client_wants(c, r = tls_handshake(c->tls)))
+			return false;
+		c->state = r == -1 ? CLIENT_DONE : CLIENT_READ;
+		return r != -1;
+	break; case CLIENT_READ:
+		r = tls_read(c->tls, &c->request[c->reqlen],
+			sizeof(c->request) - 1 - c->reqlen);
+		if (_client_wants(c, r))
+			return false;
+		if (r <= 0) {
+			c->state = CLIENT_DONE;
+			return false;
+		}
+
+		c->reqlen += r;
+		c->request[c->reqlen] = '\0';
+		if ((crlf = strstr(c->request, "\r\n"))) {
+			*crlf = '\0';
+			_dispatch(c);
+		} else if (c->reqlen == sizeof(c->request) - 1) {
+			++stats.requests;
+			_refuse(c, "59 Request too long\r\n");
+		}
+		return true;
+	break; case CLIENT_WRITE:
+		r = tls_write(c->tls, c->response + c->sent, c->len - c->sent);
+		if (_client_wants(c, r))
+			return false;
+		if (r < 0) {
+			c->state = CLIENT_DONE;
+			return false;
+		}
+
+		if ((c->sent += r) == c->len)
+			c->state = CLIENT_CLOSE;
+		return true;
+	break; case CLIENT_CLOSE:
+		if (_client_wants(c, tls_close(c->tls)))
+			return false;
+		c->state = CLIENT_DONE;
+		return false;
+	break; default:
+		return false;
+	}
+}
+
+static void
+_client_free(struct Client *c)
+{
+	/* the flight carries on without it; its response is cached for
+	 * next time */
+	if (c->flight) {
+		for (struct lnklist *l = c->flight->waiting->next; l; l = l->next) {
+			if (l->data == (void *)c) {
+				lnklist_rm(l);
+				break;
+			}
+		}
+	}
+
+	tls_free(c->tls);
+	close(c->fd);
+	free(c->response);
+	free(c);
+}
+
+static void
+_accept(int lfd)
+{
+	int fd;
+	while ((fd = accept(lfd, NULL, NULL)) != -1) {
+		struct Client *c = ecalloc(1, sizeof(struct Client));
+		c->fd = fd;
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1
+				|| fcntl(fd, F_SETFD, FD_CLOEXEC) == -1
+				|| tls_accept_socket(server, &c->tls, fd) != 0) {
+			close(fd);
+			free(c);
+			continue;
+		}
+
+		c->state = CLIENT_HANDSHAKE;
+		_client_deadline(c);
+		lnklist_push(clients, (void *)c);
+	}
+}
+
+static int
+_listen(char *port)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	}, *res, *ai;
+
+	int err = getaddrinfo(c_proxy_address, port, &hints, &res);
+	if (err) die("unable to listen on %s:%s: %s", c_proxy_address, port,
+		gai_strerror(err));
+
+	int fd = -1, one = 1;
+	for (ai = res; ai && fd == -1; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1
+				|| fcntl(fd, F_SETFD, FD_CLOEXEC) == -1
+				|| bind(fd, ai->ai_addr, ai->ai_addrlen) == -1
+				|| listen(fd, SOMAXCONN) == -1)
+			close(fd), fd = -1;
+	}
+
+	freeaddrinfo(res);
+	if (fd == -1)
+		die("unable to listen on %s:%s:", c_proxy_address, port);
+	return fd;
+}
+
+/*
+ * Serve proxy requests on port, with the given certificate and key, until
+ * interrupted. Returns what to exit with.
+ */
+int
+proxy_run(char *port, char *cert, char *key)
+{
+	struct tls_config *cfg = tls_config_new();
+	ENSURE(cfg);
+	if (tls_config_set_cert_file(cfg, cert) != 0
+			|| tls_config_set_key_file(cfg, key) != 0)
+		die("%s", tls_config_error(cfg));
+
+	server = tls_server();
+	if (!server || tls_configure(server, cfg) != 0)
+		die("unable to set up TLS: %s", server ? tls_error(server) : "");
+
+	int lfd = _listen(port);
+	clients = lnklist_new();
+	flights = lnklist_new();
+
+	struct sigaction stop = { .sa_handler = &_stop };
+	sigaction(SIGINT, &stop, NULL);
+	sigaction(SIGTERM, &stop, NULL);
+
+	/* requests to any one host are still limited */
+	fetch_limit(c_proxy_fetch_max, 0);
+
+	fprintf(stderr, "proxy: listening on %s:%s\n", c_proxy_address, port);
+
+	while (!stopping) {
+		size_t n = 1, len = lnklist_len(clients);
+		struct pollfd pfds[len + 1];
+		struct Client *polled[len + 1];
+		struct lnklist *l, *next;
+
+		pfds[0] = (struct pollfd){ .fd = lfd, .events = POLLIN };
+		for (l = clients->next; l; l = l->next) {
+			struct Client *c = (struct Client *)l->data;
+			if (!c->events) continue;
+			pfds[n] = (struct pollfd){ .fd = c->fd, .events = c->events };
+			polled[n++] = c;
+		}
+
+		fetch_poll_fds(pfds, n, 1000);
+
+		for (size_t i = 1; i < n; ++i)
+			polled[i]->revents = pfds[i].revents;
+		if (pfds[0].revents & POLLIN)
+			_accept(lfd);
+
+		struct timeval now;
+		ENSURE(gettimeofday(&now, NULL) == 0);
+
+		for (l = clients->next; l; l = next) {
+			next = l->next;
+			struct Client *c = (struct Client *)l->data;
+
+			if (!c->events || c->revents)
+				while (_client_step(c));
+			c->revents = 0;
+
+			if (c->state != CLIENT_WAIT && timercmp(&now, &c->deadline, >))
+				c->state = CLIENT_DONE;
+
+			if (c->state == CLIENT_DONE) {
+				_client_free(c);
+				lnklist_rm(l);
+			}
+		}
+	}
+
+	for (struct lnklist *l = clients->next; l; l = l->next)
+		_client_free((struct Client *)l->data);
+	lnklist_free(clients);
+
+	while (flights->next) {
+		struct Flight *fl = (struct Flight *)flights->next->data;
+		if (fl->fetch) fetch_cancel(fl->fetch);
+		_flight_free(fl);
+	}
+	lnklist_free(flights);
+
+	fetch_limit(0, 0);
+	close(lfd);
+	tls_free(server);
+	tls_config_free(cfg);
+
+	fprintf(stderr, "proxy: %zu requests: %zu from the cache, %zu from upstream, %zu joined another, %zu refused\n",
+		stats.requests, stats.hits, stats.fetched - stats.hits,
+		stats.joined, stats.refused);
+	return 0;
+}
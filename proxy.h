@@ -0,0 +1,6 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+int proxy_run(char *port, char *cert, char *key);
+
+#endif
@@ -0,0 +1,66 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "ring.h"
+#include "util.h"
+
+struct Ring *
+ring_new(size_t size)
+{
+	ENSURE(size > 0 && (size & (size - 1)) == 0);
+
+	struct Ring *r = ecalloc(1, sizeof(struct Ring));
+	r->slots = ecalloc(size, sizeof(void *));
+	r->size = size;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	return r;
+}
+
+/* producer only; returns false if the ring's full. */
+_Bool
+ring_push(struct Ring *r, void *item)
+{
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+	if (tail - head == r->size)
+		return false;
+
+	r->slots[tail & (r->size - 1)] = item;
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+/* consumer only; returns NULL if the ring's empty. */
+void *
+ring_pop(struct Ring *r)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+	if (head == tail)
+		return NULL;
+
+	void *item = r->slots[head & (r->size - 1)];
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return item;
+}
+
+/* producer only. */
+_Bool
+ring_full(struct Ring *r)
+{
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	return tail - head == r->size;
+}
+
+/* whatever's left in the ring is the caller's problem. */
+void
+ring_free(struct Ring *r)
+{
+	free(r->slots);
+	free(r);
+}
@@ -0,0 +1,24 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <sys/types.h>
+
+/*
+ * A fixed-size, lock-free queue for handing items from exactly one
+ * producer thread to exactly one consumer thread.
+ */
+struct Ring {
+	void **slots;
+	size_t size; /* a power of two */
+	_Atomic size_t head; /* next slot to pop; only moved by the consumer */
+	_Atomic size_t tail; /* next slot to push; only moved by the producer */
+};
+
+struct Ring *ring_new(size_t size);
+_Bool ring_push(struct Ring *r, void *item);
+void *ring_pop(struct Ring *r);
+_Bool ring_full(struct Ring *r);
+void ring_free(struct Ring *r);
+
+#endif
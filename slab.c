@@ -0,0 +1,167 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "slab.h"
+#include "util.h"
+
+struct Slab *
+slab_new(size_t size)
+{
+	struct Slab *s = malloc(sizeof(struct Slab) + size);
+	ENSURE(s);
+	s->refs = 1;
+	s->size = size;
+	s->next = NULL;
+	return s;
+}
+
+struct Slab *
+slab_ref(struct Slab *s)
+{
+	++s->refs;
+	return s;
+}
+
+void
+slab_unref(struct Slab *s)
+{
+	if (s && --s->refs == 0)
+		free(s);
+}
+
+/*
+ * Where (and how much) to receive into next. Once the slab's full, the
+ * line that's still coming in is moved to the start of a new one (twice
+ * its size, if it's that long), so a line is never broken up.
+ */
+char *
+slabbuf_space(struct Slabbuf *b, size_t *len)
+{
+	/* if nothing else has a hold on it, just start over */
+	if (b->slab && b->start == b->len && b->slab->refs == 1)
+		b->start = b->scan = b->len = 0;
+
+	/* one byte is always kept back for slabbuf_rest()'s \0 */
+	if (!b->slab || b->len + 1 >= b->slab->size) {
+		size_t partial = b->slab ? b->len - b->start : 0;
+		size_t size = c_slab_size;
+		while (size < partial * 2)
+			size *= 2;
+
+		struct Slab *s = slab_new(size);
+		if (partial > 0)
+			memcpy(s->data, &b->slab->data[b->start], partial);
+		slab_unref(b->slab);
+
+		b->slab = s;
+		b->scan -= b->start;
+		b->start = 0, b->len = partial;
+	}
+
+	*len = b->slab->size - b->len - 1;
+	return &b->slab->data[b->len];
+}
+
+/* len bytes were received into what slabbuf_space() returned. */
+void
+slabbuf_fill(struct Slabbuf *b, size_t len)
+{
+	b->len += len;
+}
+
+/*
+ * The next complete line (without its \n), or NULL if there isn't one
+ * yet. The line stays in b->slab, which it's only valid for as long as
+ * a reference to is held.
+ */
+char *
+slabbuf_line(struct Slabbuf *b)
+{
+	if (!b->slab)
+		return NULL;
+
+	char *nl = memchr(&b->slab->data[b->scan], '\n', b->len - b->scan);
+	if (!nl) {
+		b->scan = b->len;
+		return NULL;
+	}
+
+	*nl = '\0';
+	char *line = &b->slab->data[b->start];
+	b->start = b->scan = nl - b->slab->data + 1;
+	return line;
+}
+
+/* everything that's left, \0-terminated, whether it's a whole line or not. */
+char *
+slabbuf_rest(struct Slabbuf *b, size_t *len)
+{
+	*len = 0;
+	if (!b->slab)
+		return NULL;
+
+	char *rest = &b->slab->data[b->start];
+	*len = b->len - b->start;
+	b->slab->data[b->len] = '\0';
+	b->start = b->scan = b->len;
+	return rest;
+}
+
+void
+slabbuf_free(struct Slabbuf *b)
+{
+	slab_unref(b->slab);
+	memset(b, 0x0, sizeof(struct Slabbuf));
+}
+
+/* size zeroed bytes, which stay put until a is freed. */
+void *
+arena_alloc(struct Arena *a, size_t size)
+{
+	/* pointers (and size_t's) are all that's ever kept in these */
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	if (!a->slab || a->used + size > a->slab->size) {
+		struct Slab *s = slab_new(size > c_slab_size ? size : c_slab_size);
+		s->next = a->slab;
+		a->slab = s, a->used = 0;
+	}
+
+	void *p = &a->slab->data[a->used];
+	a->used += size;
+	memset(p, 0x0, size);
+	return p;
+}
+
+/* take over everything allocated out of `from' (which is left empty). */
+void
+arena_merge(struct Arena *a, struct Arena *from)
+{
+	if (!from->slab)
+		return;
+
+	if (!a->slab) {
+		*a = *from;
+	} else {
+		/* keep allocating out of a's slab; from's go after it */
+		struct Slab *last = from->slab;
+		while (last->next)
+			last = last->next;
+		last->next = a->slab->next;
+		a->slab->next = from->slab;
+	}
+
+	memset(from, 0x0, sizeof(struct Arena));
+}
+
+void
+arena_free(struct Arena *a)
+{
+	for (struct Slab *s = a->slab, *next; s; s = next) {
+		next = s->next;
+		slab_unref(s);
+	}
+	memset(a, 0x0, sizeof(struct Arena));
+}
@@ -0,0 +1,51 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <sys/types.h>
+
+/*
+ * Responses are received into slabs: large, reference-counted blocks of
+ * memory that lines are split out of in place. A document's lines (and
+ * their tokens' text) point straight into the slabs they arrived in, and
+ * the document holds a reference to each of them (see gemdoc_keep()).
+ */
+struct Slab {
+	size_t refs;
+	size_t size;
+	struct Slab *next; /* the one an arena had before this (see below) */
+	char data[];
+};
+
+/* a response being received, split into lines as it comes in. */
+struct Slabbuf {
+	struct Slab *slab; /* the slab being received into */
+	size_t start;      /* where the current line starts */
+	size_t scan;       /* how far it's been searched for a newline */
+	size_t len;        /* bytes received into the slab */
+};
+
+/*
+ * Small objects that live as long as a document does (its tokens, list
+ * nodes and the like) are handed out of slabs too, rather than being
+ * allocated one by one, and are all freed at once with arena_free().
+ */
+struct Arena {
+	struct Slab *slab; /* the slab being allocated out of */
+	size_t used;       /* how much of it has been */
+};
+
+struct Slab *slab_new(size_t size);
+struct Slab *slab_ref(struct Slab *s);
+void  slab_unref(struct Slab *s);
+
+char *slabbuf_space(struct Slabbuf *b, size_t *len);
+void  slabbuf_fill(struct Slabbuf *b, size_t len);
+char *slabbuf_line(struct Slabbuf *b);
+char *slabbuf_rest(struct Slabbuf *b, size_t *len);
+void  slabbuf_free(struct Slabbuf *b);
+
+void *arena_alloc(struct Arena *a, size_t size);
+void  arena_merge(struct Arena *a, struct Arena *from);
+void  arena_free(struct Arena *a);
+
+#endif
@@ -0,0 +1,366 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "list.h"
+#include "store.h"
+#include "util.h"
+
+/*
+ * On-disk response store, under $XDG_CACHE_HOME/mebsuta (or
+ * ~/.cache/mebsuta). Responses are kept in objects/, named after a hash
+ * of their contents, so identical responses are only stored once. The
+ * index maps cache keys to objects; it's an append-only log of
+ *
+ *     <hash> <time stored> <length> <key>
+ *
+ * lines, the last line for a key being the one that counts. It's mapped
+ * and read in one go at startup.
+ */
+static char *dir = NULL;
+static int index_fd = -1;
+static struct lnklist *entries = NULL;
+
+/*
+ * Permanent redirects are logged in the same way, to `redirects', as
+ * "<key> <target>" lines; a target of "-" forgets the redirect.
+ */
+static int redirects_fd = -1;
+static struct lnklist *redirects = NULL;
+
+static void
+_entry_free(struct StoreEntry *e)
+{
+	free(e->key);
+	free(e);
+}
+
+static struct StoreEntry *
+_find(char *key)
+{
+	if (!entries) return NULL;
+
+	for (struct lnklist *l = entries->next; l; l = l->next)
+		if (!strcmp(((struct StoreEntry *)l->data)->key, key))
+			return (struct StoreEntry *)l->data;
+	return NULL;
+}
+
+/* FNV-1a */
+static uint64_t
+_hash(char *data, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325;
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)data[i]) * 0x100000001b3;
+	return h;
+}
+
+static char *
+_object_path(uint64_t hash)
+{
+	return format("%s/objects/%016" PRIx64, dir, hash);
+}
+
+static _Bool
+_mkdir(char *path)
+{
+	return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+static void
+_add(char *key, uint64_t hash, time_t stored, size_t len)
+{
+	struct StoreEntry *e = _find(key);
+	if (!e) {
+		e = ecalloc(1, sizeof(struct StoreEntry));
+		e->key = strdup(key);
+		lnklist_push(entries, (void *)e);
+	}
+
+	e->hash = hash, e->stored = stored, e->len = len;
+}
+
+static struct lnklist *
+_find_redirect(char *key)
+{
+	if (!redirects) return NULL;
+
+	for (struct lnklist *l = redirects->next; l; l = l->next)
+		if (!strcmp(((struct StoreRedirect *)l->data)->key, key))
+			return l;
+	return NULL;
+}
+
+static void
+_redirect_free(struct lnklist *l)
+{
+	struct StoreRedirect *r = (struct StoreRedirect *)l->data;
+	free(r->key), free(r->target), free(r);
+	lnklist_rm(l);
+}
+
+static void
+_add_redirect(char *key, char *target)
+{
+	struct lnklist *l = _find_redirect(key);
+	if (l) _redirect_free(l);
+	if (!strcmp(target, "-")) return;
+
+	struct StoreRedirect *r = ecalloc(1, sizeof(struct StoreRedirect));
+	r->key = strdup(key), r->target = strdup(target);
+	lnklist_push(redirects, (void *)r);
+}
+
+static void
+_parse_index_line(char *line)
+{
+	uint64_t hash;
+	long long stored;
+	size_t len;
+	int keyat = 0;
+
+	if (sscanf(line, "%" SCNx64 " %lld %zu %n", &hash, &stored,
+			&len, &keyat) == 3 && keyat && line[keyat])
+		_add(&line[keyat], hash, (time_t)stored, len);
+}
+
+static void
+_parse_redirects_line(char *line)
+{
+	char *target = strchr(line, ' ');
+	if (!target || !target[1]) return;
+
+	*target++ = '\0';
+	_add_redirect(line, target);
+}
+
+/* map a log and feed it to parse() a line at a time. */
+void
+store_load_log(int fd, void (*parse)(char *line))
+{
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size == 0)
+		return;
+
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return;
+
+	/* anything malformed (e.g. a line cut short by a crash) is skipped */
+	char *p = map, *end = map + st.st_size, *nl;
+	for (; p < end && (nl = memchr(p, '\n', end - p)); p = nl + 1) {
+		char line[4096];
+		if ((size_t)(nl - p) >= sizeof(line))
+			continue;
+		memcpy(line, p, nl - p);
+		line[nl - p] = '\0';
+		(parse)(line);
+	}
+
+	munmap(map, st.st_size);
+}
+
+/*
+ * Open (creating it if need be) the append-only log `name' in the store,
+ * for reading with store_load_log() and appending to. Returns -1 if the
+ * store's disabled.
+ */
+int
+store_open_log(char *name)
+{
+	if (!dir) return -1;
+	return open(format("%s/%s", dir, name),
+		O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+}
+
+/*
+ * Open the store, creating it if need be. Returns false (and the store
+ * stays disabled) if it's turned off or can't be set up.
+ */
+_Bool
+store_init(void)
+{
+	if (!c_store || dir)
+		return dir != NULL;
+
+	char *base = getenv("XDG_CACHE_HOME");
+	char *home = getenv("HOME");
+
+	if (base && *base)
+		dir = strdup(format("%s/mebsuta", base));
+	else if (home && *home)
+		dir = strdup(format("%s/.cache/mebsuta", home));
+	else
+		return false;
+
+	if (!base || !*base)
+		_mkdir(format("%s/.cache", home));
+
+	if (!_mkdir(dir) || !_mkdir(format("%s/objects", dir)))
+		goto fail;
+
+	if ((index_fd = store_open_log("index")) == -1)
+		goto fail;
+	if ((redirects_fd = store_open_log("redirects")) == -1)
+		goto fail;
+
+	entries = lnklist_new();
+	redirects = lnklist_new();
+	store_load_log(index_fd, &_parse_index_line);
+	store_load_log(redirects_fd, &_parse_redirects_line);
+	return true;
+
+fail:
+	if (index_fd != -1) close(index_fd);
+	index_fd = -1;
+	free(dir);
+	dir = NULL;
+	return false;
+}
+
+/*
+ * Map the response stored for key. The mapping is read-only, and must be
+ * handed back to store_release() once it's been parsed.
+ */
+_Bool
+store_get(char *key, char **data, size_t *len, time_t *stored)
+{
+	struct StoreEntry *e = _find(key);
+	if (!e || e->len == 0)
+		return false;
+
+	int fd = open(_object_path(e->hash), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+
+	/* the object might have been removed or truncated behind our back */
+	struct stat st;
+	char *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size == e->len)
+		map = mmap(NULL, e->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	*data = map, *len = e->len, *stored = e->stored;
+	return true;
+}
+
+void
+store_release(char *data, size_t len)
+{
+	munmap(data, len);
+}
+
+_Bool
+store_contains(char *key)
+{
+	return _find(key) != NULL;
+}
+
+/* store a response; data still belongs to the caller. */
+void
+store_put(char *key, char *data, size_t len)
+{
+	if (!dir || len == 0 || len > c_store_max_response)
+		return;
+
+	uint64_t hash = _hash(data, len);
+	struct StoreEntry *e = _find(key);
+	if (e && e->hash == hash && e->len == len)
+		return;
+
+	char *path = strdup(_object_path(hash));
+	struct stat st;
+
+	if (stat(path, &st) == -1 || (size_t)st.st_size != len) {
+		/* write to a temporary file first, so that a crash can't
+		 * leave a half-written object behind */
+		char *tmp = strdup(format("%s.tmp", path));
+		int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		_Bool ok = fd != -1;
+
+		for (size_t written = 0; ok && written < len; ) {
+			ssize_t w = write(fd, data + written, len - written);
+			if (w == -1 && errno == EINTR) continue;
+			ok = w > 0;
+			written += ok ? (size_t)w : 0;
+		}
+
+		if (fd != -1) close(fd);
+		ok = ok && rename(tmp, path) == 0;
+		if (!ok) unlink(tmp);
+
+		free(tmp);
+		if (!ok) {
+			free(path);
+			return;
+		}
+	}
+
+	free(path);
+
+	time_t now = time(NULL);
+	char *line = format("%016" PRIx64 " %lld %zu %s\n", hash,
+		(long long)now, len, key);
+	if (write(index_fd, line, strlen(line)) == (ssize_t)strlen(line))
+		_add(key, hash, now, len);
+}
+
+char *
+store_redirected(char *key)
+{
+	struct lnklist *l = _find_redirect(key);
+	return l ? ((struct StoreRedirect *)l->data)->target : NULL;
+}
+
+/* remember (or, if target is NULL, forget) a permanent redirect. */
+void
+store_redirect(char *key, char *target)
+{
+	if (!dir) return;
+
+	char *old = store_redirected(key);
+	if (!target && !old)
+		return;
+	if (target && old && !strcmp(target, old))
+		return;
+
+	char *line = format("%s %s\n", key, target ? target : "-");
+	if (write(redirects_fd, line, strlen(line)) == (ssize_t)strlen(line))
+		_add_redirect(key, target ? target : "-");
+}
+
+void
+store_free(void)
+{
+	if (!dir) return;
+
+	for (struct lnklist *l = entries->next; l; l = l->next)
+		_entry_free((struct StoreEntry *)l->data);
+	lnklist_free(entries);
+	entries = NULL;
+
+	while (redirects->next)
+		_redirect_free(redirects->next);
+	lnklist_free(redirects);
+	redirects = NULL;
+
+	close(index_fd), close(redirects_fd);
+	index_fd = redirects_fd = -1;
+
+	free(dir);
+	dir = NULL;
+}
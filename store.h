@@ -0,0 +1,32 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+/* the latest response stored for a cache key. */
+struct StoreEntry {
+	char *key;
+	uint64_t hash; /* of the response; also the name of its object file */
+	time_t stored;
+	size_t len;
+};
+
+/* a permanent redirect. */
+struct StoreRedirect {
+	char *key, *target;
+};
+
+_Bool store_init(void);
+_Bool store_get(char *key, char **data, size_t *len, time_t *stored);
+void  store_release(char *data, size_t len);
+_Bool store_contains(char *key);
+void  store_put(char *key, char *data, size_t len);
+char *store_redirected(char *key);
+void  store_redirect(char *key, char *target);
+int   store_open_log(char *name);
+void  store_load_log(int fd, void (*parse)(char *line));
+void  store_free(void);
+
+#endif
@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include "fetch.h"
 #include "list.h"
 #include "tabs.h"
 #include "util.h"
@@ -36,7 +37,10 @@ void
 tabs_rm(struct lnklist *tab)
 {
 	ENSURE(tab);
-	hist_free(((struct Tab *)tab->data)->visited);
+	struct Tab *t = (struct Tab *)tab->data;
+	if (t->fetch)
+		fetch_cancel(t->fetch);
+	hist_free(t->visited);
 	free(tab->data);
 	ENSURE(lnklist_rm(tab));
 }
@@ -47,7 +51,10 @@ tabs_free(void)
 	for (struct lnklist *l = tabs->next; l; l = l->next) {
 		if (!l->data) continue;
 
-		hist_free(((struct Tab *)l->data)->visited);
+		struct Tab *t = (struct Tab *)l->data;
+		if (t->fetch)
+			fetch_cancel(t->fetch);
+		hist_free(t->visited);
 		free(l->data);
 
 		/* Don't free t.doc, since that pointer was present
@@ -1,9 +1,14 @@
+#include "fetch.h"
 #include "list.h"
 #include "ui.h"
 
 struct Tab {
 	struct lnklist *visited;
 
+	/* in-flight request, if any */
+	struct Fetch *fetch;
+	size_t redirects;
+
 	size_t ui_vscroll, ui_hscroll;
 	char ui_messagebuf[255];
 	enum UiMessageType ui_message_type;
@@ -0,0 +1,384 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "list.h"
+#include "trace.h"
+#include "util.h"
+
+#define EV_OPEN   0
+#define EV_READY  1
+#define EV_SEND   2
+#define EV_RECV   3
+#define EV_EOF    4
+#define EV_ERROR  5
+#define EV_CLOSE  6
+
+static const char *events[] = {
+	[EV_OPEN]  = "open",  [EV_READY] = "ready", [EV_SEND]  = "send",
+	[EV_RECV]  = "recv",  [EV_EOF]   = "eof",   [EV_ERROR] = "error",
+	[EV_CLOSE] = "close",
+};
+
+struct Event {
+	size_t type;
+	long ms;
+	char *data; /* in the mapped trace */
+	size_t len;
+};
+
+/* a connection, as recorded. */
+struct Recorded {
+	size_t id;
+	char *host, *port;
+	struct lnklist *events;
+	_Bool claimed; /* by a replayed connection */
+};
+
+struct Trace {
+	size_t id;
+	struct timeval opened;
+
+	/* replaying: how long the handshake takes, the recording this
+	 * connection's replaying, the next event and how much of it's
+	 * been replayed, and when the recording's time 0 is, in real
+	 * time */
+	char *host, *port;
+	long handshake;
+	struct Recorded *r;
+	struct lnklist *next;
+	size_t off;
+	struct timeval base;
+};
+
+static struct timeval epoch;
+
+/* recording */
+static FILE *out = NULL;
+static size_t ids = 0;
+
+/* replaying */
+static struct lnklist *recorded = NULL;
+static char *map = NULL;
+static size_t maplen = 0;
+static double scale = 1.0;
+
+static long
+_ms(struct timeval *since)
+{
+	struct timeval now, elapsed;
+	ENSURE(gettimeofday(&now, NULL) == 0);
+	timersub(&now, since, &elapsed);
+	return elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000;
+}
+
+/* milliseconds (of real time) until an event recorded at ms is due. */
+static long
+_due(struct Trace *t, long ms)
+{
+	return (long)(ms * scale) - _ms(&t->base);
+}
+
+_Bool
+trace_record(char *path)
+{
+	ENSURE(!out), ENSURE(!recorded);
+
+	if (!(out = fopen(path, "w")))
+		return false;
+
+	ENSURE(gettimeofday(&epoch, NULL) == 0);
+	return true;
+}
+
+static struct Recorded *
+_find(size_t id)
+{
+	/* events tend to come in runs for the same connection */
+	for (struct lnklist *l = lnklist_tail(recorded); l && l->data; l = l->prev)
+		if (((struct Recorded *)l->data)->id == id)
+			return (struct Recorded *)l->data;
+	return NULL;
+}
+
+static void
+_load(char *p, char *end)
+{
+	while (p < end) {
+		size_t id, len, type;
+		long ms;
+		char name[16];
+		int n = 0;
+
+		char *nl = memchr(p, '\n', end - p);
+		if (!nl || sscanf(p, "%zu %ld %15s %zu%n", &id, &ms, name,
+				&len, &n) != 4 || p + n != nl)
+			return;
+		p = nl + 1;
+
+		/* a trace cut short is fine; we just stop there */
+		if ((size_t)(end - p) < len + 1)
+			return;
+
+		for (type = 0; type < SIZEOF(events); ++type)
+			if (!strcmp(name, events[type]))
+				break;
+
+		struct Recorded *r = _find(id);
+		if (type == EV_OPEN) {
+			char *sp = memchr(p, ' ', len);
+			if (!sp) return;
+
+			r = ecalloc(1, sizeof(struct Recorded));
+			r->id = id;
+			r->host = strndup(p, sp - p);
+			r->port = strndup(sp + 1, len - (sp + 1 - p));
+			r->events = lnklist_new();
+			lnklist_push(recorded, (void *)r);
+		}
+
+		if (r && type < SIZEOF(events)) {
+			struct Event *e = ecalloc(1, sizeof(struct Event));
+			e->type = type, e->ms = ms;
+			e->data = p, e->len = len;
+			lnklist_push(r->events, (void *)e);
+		}
+
+		p += len + 1;
+	}
+}
+
+/*
+ * Replay the trace at path instead of going anywhere near the network.
+ * Timings are multiplied by s, so 1 replays the trace in real time and 0
+ * as fast as possible.
+ */
+_Bool
+trace_replay(char *path, double s)
+{
+	ENSURE(!out), ENSURE(!recorded);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		return false;
+	}
+
+	maplen = st.st_size, scale = s;
+	recorded = lnklist_new();
+	_load(map, map + maplen);
+	return true;
+}
+
+_Bool
+trace_replaying(void)
+{
+	return recorded != NULL;
+}
+
+void
+trace_finish(void)
+{
+	if (out) fclose(out);
+	out = NULL;
+
+	if (!recorded) return;
+
+	for (struct lnklist *l = recorded->next; l; l = l->next) {
+		struct Recorded *r = (struct Recorded *)l->data;
+		free(r->host), free(r->port);
+		lnklist_free_all(r->events);
+		free(r);
+	}
+	lnklist_free(recorded);
+	recorded = NULL;
+
+	munmap(map, maplen);
+	map = NULL;
+}
+
+/* start tracing a new connection; NULL if we aren't tracing. */
+struct Trace *
+trace_open(char *host, char *port)
+{
+	if (!out && !recorded)
+		return NULL;
+
+	struct Trace *t = ecalloc(1, sizeof(struct Trace));
+	ENSURE(gettimeofday(&t->opened, NULL) == 0);
+	t->base = t->opened;
+
+	if (recorded) {
+		t->host = strdup(host), t->port = strdup(port);
+		return t;
+	}
+
+	t->id = ++ids;
+	char *hp = format("%s %s", host, port);
+	trace_log(t, "open", hp, strlen(hp));
+	return t;
+}
+
+/* record an event; does nothing unless we're recording. */
+void
+trace_log(struct Trace *t, char *event, char *data, size_t len)
+{
+	if (!t || !out) return;
+
+	fprintf(out, "%zu %ld %s %zu\n", t->id, _ms(&epoch), event, len);
+	if (len > 0) fwrite(data, 1, len, out);
+	fputc('\n', out);
+}
+
+void
+trace_close(struct Trace *t)
+{
+	if (!t) return;
+
+	trace_log(t, "close", NULL, 0);
+	if (out) fflush(out);
+
+	free(t->host), free(t->port);
+	free(t);
+}
+
+/* the first event of the given type in r (after `from', if given). */
+static struct lnklist *
+_event(struct Recorded *r, size_t type, struct lnklist *from)
+{
+	struct lnklist *l = from ? from->next : r->events->next;
+	for (; l; l = l->next)
+		if (((struct Event *)l->data)->type == type)
+			return l;
+	return NULL;
+}
+
+/*
+ * Connections aren't tied to a recording until they send something (see
+ * trace_send()), so the handshake takes as long as the next unclaimed
+ * connection to the same place took.
+ */
+int
+trace_handshake(struct Trace *t)
+{
+	for (struct lnklist *l = recorded->next; l; l = l->next) {
+		struct Recorded *r = (struct Recorded *)l->data;
+		if (r->claimed || strcmp(r->host, t->host) || strcmp(r->port, t->port))
+			continue;
+
+		struct lnklist *open = _event(r, EV_OPEN, NULL);
+		struct lnklist *ready = _event(r, EV_READY, NULL);
+		if (!open || !ready)
+			continue;
+
+		t->handshake = (long)((((struct Event *)ready->data)->ms
+			- ((struct Event *)open->data)->ms) * scale);
+		break;
+	}
+
+	return t->handshake > _ms(&t->opened) ? CONN_AGAIN : CONN_DONE;
+}
+
+/*
+ * The first send picks the recording to replay: the first one to the same
+ * place that sent the same thing. Everything's always sent in one go.
+ */
+ssize_t
+trace_send(struct Trace *t, char *data, size_t len, char **error)
+{
+	if (t->r)
+		return len;
+
+	for (struct lnklist *l = recorded->next; l; l = l->next) {
+		struct Recorded *r = (struct Recorded *)l->data;
+		if (r->claimed || strcmp(r->host, t->host) || strcmp(r->port, t->port))
+			continue;
+
+		struct lnklist *send = _event(r, EV_SEND, NULL);
+		struct Event *e = send ? (struct Event *)send->data : NULL;
+		if (!e || e->len != len || memcmp(e->data, data, len))
+			continue;
+
+		/* replay what came back relative to now, not to when the
+		 * connection was opened */
+		long back = (long)(e->ms * scale);
+		struct timeval since = { back / 1000, (back % 1000) * 1000 };
+		ENSURE(gettimeofday(&t->base, NULL) == 0);
+		timersub(&t->base, &since, &t->base);
+
+		r->claimed = true;
+		t->r = r, t->next = send->next, t->off = 0;
+		return len;
+	}
+
+	*error = "request isn't in the trace";
+	return -2;
+}
+
+/* like conn_recv(): bytes replayed, 0 if none are due yet, -1 on EOF and -2 on error. */
+ssize_t
+trace_recv(struct Trace *t, char *buf, size_t sz, char **error)
+{
+	if (!t->r)
+		return 0;
+
+	for (; t->next; t->next = t->next->next, t->off = 0) {
+		struct Event *e = (struct Event *)t->next->data;
+		if (e->type != EV_RECV && e->type != EV_EOF && e->type != EV_ERROR)
+			continue;
+		if (_due(t, e->ms) > 0)
+			return 0;
+
+		switch (e->type) {
+		break; case EV_EOF:
+			return -1;
+		break; case EV_ERROR:
+			*error = format("%.*s", (int)e->len, e->data);
+			return -2;
+		}
+
+		size_t n = MAX(e->len - t->off, sz);
+		memcpy(buf, e->data + t->off, n);
+		if ((t->off += n) == e->len)
+			t->next = t->next->next, t->off = 0;
+		return n;
+	}
+
+	/* the recording stopped short; call it the end */
+	return -1;
+}
+
+/* shorten a poll(2) timeout so that we're back in time for the next event. */
+int
+trace_timeout(struct Trace *t, int timeout)
+{
+	long ms;
+	if (!t->r)
+		ms = t->handshake - _ms(&t->opened);
+	else if (t->next)
+		ms = _due(t, ((struct Event *)t->next->data)->ms);
+	else
+		return timeout;
+
+	if (ms < 0) ms = 0;
+	return timeout < 0 || ms < timeout ? (int)ms : timeout;
+}
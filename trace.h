@@ -0,0 +1,36 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <sys/types.h>
+
+/*
+ * A trace is a record of every connection made: when it was opened and
+ * ready, what was sent over it, and what came back when. Recorded traces
+ * can be replayed in place of the network (see conn.c), with their
+ * original timings, scaled ones, or none at all.
+ *
+ * Traces are a series of
+ *
+ *     <connection> <ms since start> <event> <length>\n<data>\n
+ *
+ * records, where the event is one of open (data is "<host> <port>"),
+ * ready, send, recv, eof, error (data is the message) or close.
+ */
+struct Trace;
+
+_Bool trace_record(char *path);
+_Bool trace_replay(char *path, double scale);
+_Bool trace_replaying(void);
+void  trace_finish(void);
+
+struct Trace *trace_open(char *host, char *port);
+void  trace_log(struct Trace *t, char *event, char *data, size_t len);
+void  trace_close(struct Trace *t);
+
+/* replaying only */
+int     trace_handshake(struct Trace *t);
+ssize_t trace_send(struct Trace *t, char *data, size_t len, char **error);
+ssize_t trace_recv(struct Trace *t, char *buf, size_t sz, char **error);
+int     trace_timeout(struct Trace *t, int timeout);
+
+#endif
@@ -8,6 +8,7 @@
 
 #include "config.h"
 #include "curl/url.h"
+#include "fetch.h"
 #include "gemini.h"
 #include "history.h"
 #include "list.h"
@@ -237,15 +238,15 @@ format_elem(struct Gemtok *l, char *text, size_t lnk, size_t folded)
 }
 
 static size_t
-_ui_redraw_rendered_doc(void)
+_ui_redraw_rendered_doc(struct Gemdoc *g)
 {
-	ENSURE(CURDOC() != NULL);
+	ENSURE(g != NULL);
 
 	size_t line = 1;
 
 	size_t links = 0, page_height = 0;
 	ssize_t scrollctr = CURTAB()->ui_vscroll;
-	for (struct lnklist *c = CURDOC()->document->next; c; c = c->next) {
+	for (struct lnklist *c = g->document->next; c; c = c->next) {
 		struct Gemtok *l = ((struct Gemtok *)c->data);
 		char *text = l->text;
 
@@ -273,11 +274,11 @@ _ui_redraw_rendered_doc(void)
 }
 
 static size_t
-_ui_redraw_raw_doc(void)
+_ui_redraw_raw_doc(struct Gemdoc *g)
 {
 	size_t line = 1, page_height = 0;
 	ssize_t scrollctr = CURTAB()->ui_vscroll;
-	for (struct lnklist *c = CURDOC()->rawdoc->next; c; c = c->next) {
+	for (struct lnklist *c = g->rawdoc->next; c; c = c->next) {
 		if (--scrollctr >= 0) continue;
 		tb_writeline(line, (char *)c->data, CURTAB()->ui_hscroll);
 		++page_height;
@@ -286,13 +287,30 @@ _ui_redraw_raw_doc(void)
 	return page_height;
 }
 
+/* plain text documents are just their lines, sans the response line. */
 static size_t
-_ui_redraw_other_doc(void)
+_ui_redraw_plain_doc(struct Gemdoc *g)
+{
+	size_t line = 1;
+	ssize_t scrollctr = CURTAB()->ui_vscroll;
+	ssize_t page_height = lnklist_len(g->rawdoc) - 1;
+
+	for (struct lnklist *c = g->rawdoc->next->next; c; c = c->next) {
+		if (--scrollctr >= 0) continue;
+		tb_writeline(line, (char *)c->data, CURTAB()->ui_hscroll);
+		if (++line >= ui_height-3) break;
+	}
+
+	return page_height > 0 ? (size_t)page_height : 0;
+}
+
+static size_t
+_ui_redraw_other_doc(struct Gemdoc *g)
 {
 	struct Gemtok line = {
 		.type = GEM_DATA_HEADER1,
 		.text = strdup(format("%d %s",
-				CURDOC()->status, CURDOC()->meta))
+				g->status, g->meta))
 	};
 
 	tb_writeline(1,
@@ -331,76 +349,119 @@ _ui_redraw_inputline(void)
 		tb_set_cursor(TB_HIDE_CURSOR, TB_HIDE_CURSOR);
 }
 
+static char *
+_tab_title(struct lnklist *tab)
+{
+	struct Tab *t = (struct Tab *)tab->data;
+	struct Gemdoc *g = (struct Gemdoc *)t->visited->data;
+
+	if (g)
+		return g->title;
+	else if (t->fetch)
+		return (char *)fetch_state_name(t->fetch->state);
+	else
+		return "...";
+}
+
 static void
 _ui_redraw_tabline(void)
 {
-	char linebuf[ui_width + 1];
+	/* leave room for the color codes */
+	char linebuf[ui_width * 8 + 1];
 	memset(linebuf, 0x0, sizeof(linebuf));
 
 	strcat(linebuf, "\0030,252 ");
 
 	size_t l;
 	struct lnklist *fst = curtab;
-	void *tabhist;
 
-	for (l = 0; fst && fst->data && l < ui_width / 2; fst = fst->prev) {
-		tabhist = ((struct Tab *)fst->data)->visited->data;
-		l += strlen(((struct Gemdoc *)tabhist)->title) + 3;
-	}
+	for (l = 0; fst && fst->data && l < ui_width / 2; fst = fst->prev)
+		l += strlen(_tab_title(fst)) + 3;
 
 	if (!fst->data && fst->next->data)
 		fst = fst->next;
 
 	for (l = 0; fst && l < ui_width; fst = fst->next) {
-		tabhist = ((struct Tab *)fst->data)->visited->data;
-		char *p = ((struct Gemdoc *)tabhist)->title;
-		if (fst == curtab)
-			strcat(linebuf, "\0030,0");
+		char *p = _tab_title(fst);
+
+		/* tabs that are still loading are greyed out */
+		strcat(linebuf, format("\003%s,%s",
+			((struct Tab *)fst->data)->fetch ? "244" : "0",
+			fst == curtab ? "0" : "252"));
 		strcat(linebuf, "  "), ++l;
 		strcat(linebuf, p), l += strlen(p);
 		if (l < ui_width - 1)
 			strcat(linebuf, "  "), l += 2;
-		if (fst == curtab)
-			strcat(linebuf, "\0030,252");
+		strcat(linebuf, "\0030,252");
 	}
 
-	strcat(linebuf, strrep(' ', ui_width - l));
+	strcat(linebuf, strrep(' ', CHKSUB(ui_width, l)));
 	tb_writeline(0, linebuf, 0);
 }
 
 static void
-_ui_redraw_statusline(size_t page_height)
+_ui_redraw_statusline(struct Gemdoc *g, size_t page_height)
 {
 	size_t read = (CURTAB()->ui_vscroll * 100) / (page_height);
-	tb_writeline(ui_height-2, statusline(ui_width, read, CURDOC()), 0);
+	tb_writeline(ui_height-2,
+		statusline(ui_width, read, g, CURTAB()->fetch), 0);
+}
+
+static _Bool
+_has_lines(struct lnklist *l, size_t n)
+{
+	for (l = l->next; l && n > 0; l = l->next, --n);
+	return n == 0;
+}
+
+/*
+ * What to show for the current tab: the page that's loading, once a
+ * screenful of it is in, or else the last page visited.
+ */
+struct Gemdoc *
+ui_doc(void)
+{
+	struct Fetch *f = CURTAB()->fetch;
+	if (!f || (f->state != FETCH_RECV && f->state != FETCH_PARSE)
+			|| !f->header || f->saveto
+			|| f->doc->type != GEM_TYPE_SUCCESS)
+		return CURDOC();
+
+	struct lnklist *lines = f->doc->format == GEM_FORMAT_PLAIN
+		? f->doc->rawdoc : f->doc->document;
+	return _has_lines(lines, ui_height) ? f->doc : CURDOC();
 }
 
 size_t
 ui_redraw(void)
 {
-	ENSURE(CURTAB()), ENSURE(CURDOC());
+	ENSURE(CURTAB());
 	tb_clear();
 
 	_ui_redraw_tabline();
 
 	size_t page_height = 0;
+	struct Gemdoc *g = ui_doc();
 
-	switch (CURDOC()->type) {
+	/* a new tab that's still loading has nothing to show yet */
+	switch (g ? g->type : 0) {
 	break; case GEM_TYPE_SUCCESS:
 		if (BITSET(CURTAB()->ui_doc_mode, UI_DOCRAW))
-			page_height = _ui_redraw_raw_doc();
+			page_height = _ui_redraw_raw_doc(g);
+		else if (g->format == GEM_FORMAT_PLAIN)
+			page_height = _ui_redraw_plain_doc(g);
 		else
-			page_height = _ui_redraw_rendered_doc();
+			page_height = _ui_redraw_rendered_doc(g);
 	break; case 0:
 		/* do nothing */
 	break; default:
-		page_height = _ui_redraw_other_doc();
+		page_height = _ui_redraw_other_doc(g);
 	}
 
 	/* add 1 to page_height to prevent div-by-0 errors */
 	page_height = page_height + 1;
 
-	_ui_redraw_statusline(page_height);
+	_ui_redraw_statusline(g, page_height);
 	_ui_redraw_inputline();
 
 	return page_height;
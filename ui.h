@@ -28,6 +28,7 @@ enum UiDocumentMode {
 void ui_init(void);
 void ui_present(void);
 void ui_set_gemdoc(struct Gemdoc *g);
+struct Gemdoc *ui_doc(void);
 size_t ui_redraw(void);
 void ui_message(enum UiMessageType type, const char *fmt, ...);
 void ui_handle(struct tb_event *ev);